@@ -0,0 +1,141 @@
+#include "asset_bundle.h"
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_partition.h>
+
+static const char* TAG = "esp_wifi_portal";
+
+static esp_partition_mmap_handle_t bundle_mmap;
+static const uint8_t* bundle = NULL;
+static const uint16_t* bundle_slots = NULL;
+static const asset_bundle_record_t* bundle_records = NULL;
+
+/* FNV-1a, the packer hashes the paths the same way */
+static uint32_t path_hash(const char* path, const size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* A NUL terminated string starting at `off` within the bundle */
+static bool string_valid(const uint32_t off, const uint32_t total_size)
+{
+    return off < total_size && memchr(bundle + off, '\0', total_size - off) != NULL;
+}
+
+static esp_err_t validate(const uint32_t partition_size)
+{
+    const asset_bundle_header_t* header = (const asset_bundle_header_t*)bundle;
+    if (header->magic != ASSET_BUNDLE_MAGIC || header->version != ASSET_BUNDLE_VERSION)
+    {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    const uint32_t total_size = header->total_size;
+    const uint32_t records_off = (sizeof(asset_bundle_header_t) + header->slots * sizeof(uint16_t) + 3) & ~3u;
+    if (total_size > partition_size || header->slots == 0 || (header->slots & (header->slots - 1)) != 0 ||
+        header->count >= header->slots || records_off + header->count * sizeof(asset_bundle_record_t) > total_size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    bundle_slots = (const uint16_t*)(bundle + sizeof(asset_bundle_header_t));
+    bundle_records = (const asset_bundle_record_t*)(bundle + records_off);
+
+    for (int i = 0; i < header->slots; i++)
+    {
+        if (bundle_slots[i] > header->count)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    for (int i = 0; i < header->count; i++)
+    {
+        const asset_bundle_record_t* record = &bundle_records[i];
+        if (!string_valid(record->path_off, total_size) || !string_valid(record->mime_off, total_size) ||
+            record->data_off > total_size || record->data_len > total_size - record->data_off)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t asset_bundle_open(const char* partition_label)
+{
+    if (bundle != NULL)
+    {
+        return ESP_OK;
+    }
+    const esp_partition_t* partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (partition == NULL)
+    {
+        ESP_LOGW(TAG, "No asset partition '%s'", partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    const void* ptr;
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &ptr, &bundle_mmap);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to map asset partition, err: %d", err);
+        return err;
+    }
+    bundle = ptr;
+    err = validate(partition->size);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Asset partition '%s' holds no valid bundle, err: %d", partition_label, err);
+        asset_bundle_close();
+        return err;
+    }
+    ESP_LOGI(TAG, "Asset bundle with %d files mapped", ((const asset_bundle_header_t*)bundle)->count);
+    return ESP_OK;
+}
+
+void asset_bundle_close(void)
+{
+    if (bundle != NULL)
+    {
+        esp_partition_munmap(bundle_mmap);
+        bundle = NULL;
+        bundle_slots = NULL;
+        bundle_records = NULL;
+    }
+}
+
+bool asset_bundle_find(const char* path, const size_t path_len, asset_bundle_entry_t* entry)
+{
+    if (bundle == NULL)
+    {
+        return false;
+    }
+    const asset_bundle_header_t* header = (const asset_bundle_header_t*)bundle;
+    const uint32_t hash = path_hash(path, path_len);
+    const uint32_t mask = header->slots - 1;
+    // count < slots, so there is always an empty slot ending the probe
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        if (bundle_slots[i] == 0)
+        {
+            return false;
+        }
+        const asset_bundle_record_t* record = &bundle_records[bundle_slots[i] - 1];
+        const char* record_path = (const char*)bundle + record->path_off;
+        if (record->hash == hash && strncmp(record_path, path, path_len) == 0 && record_path[path_len] == '\0')
+        {
+            entry->path = record_path;
+            entry->mime = (const char*)bundle + record->mime_off;
+            entry->data = bundle + record->data_off;
+            entry->len = record->data_len;
+            entry->crc = record->crc;
+            entry->gzip = record->encoding == ASSET_BUNDLE_ENCODING_GZIP;
+            return true;
+        }
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bundle layout, little endian, as written by tools/pack_assets.py:
+ *
+ *   asset_bundle_header_t
+ *   uint16_t slot[slots]           open addressing table over the path hash, entry index + 1, 0 for empty
+ *   asset_bundle_record_t entry[count]
+ *   NUL terminated paths and MIME types
+ *   content of every entry, 4 byte aligned
+ */
+#define ASSET_BUNDLE_MAGIC 0x31424150 /* "PAB1" */
+#define ASSET_BUNDLE_VERSION 1
+
+#define ASSET_BUNDLE_ENCODING_IDENTITY 0
+#define ASSET_BUNDLE_ENCODING_GZIP 1
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;         /**<! Number of entries */
+    uint16_t slots;         /**<! Size of the slot table, a power of two larger than count */
+    uint16_t reserved;
+    uint32_t total_size;    /**<! Size of the whole bundle */
+} asset_bundle_header_t;
+
+typedef struct {
+    uint32_t hash;          /**<! FNV-1a of the path */
+    uint32_t path_off;      /**<! Offsets from the start of the bundle */
+    uint32_t mime_off;
+    uint32_t data_off;
+    uint32_t data_len;
+    uint32_t crc;           /**<! CRC-32 of the stored content, used as ETag */
+    uint8_t encoding;       /**<! ASSET_BUNDLE_ENCODING_* of the stored content */
+    uint8_t reserved[3];
+} asset_bundle_record_t;
+
+/**
+ * @brief One asset, all pointers point into mapped flash
+ */
+typedef struct asset_bundle_entry {
+    const char* path;
+    const char* mime;
+    const uint8_t* data;
+    uint32_t len;
+    uint32_t crc;
+    bool gzip;              /**<! The content is gzip-compressed and has to be sent with Content-Encoding: gzip */
+} asset_bundle_entry_t;
+
+/**
+ * @brief Map the bundle in a data partition and validate it
+ *
+ * Every offset is checked here once, so lookups can trust the index.
+ *
+ * @param partition_label Label of the partition holding the bundle
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND without the partition, ESP_ERR_INVALID_VERSION or
+ *         ESP_ERR_INVALID_SIZE for a bundle that is not valid
+ */
+esp_err_t asset_bundle_open(const char* partition_label);
+
+/**
+ * @brief Unmap the bundle, entries found before must not be used anymore
+ */
+void asset_bundle_close(void);
+
+/**
+ * @brief Look up an asset by path in constant time
+ *
+ * @param path Path of the asset, e.g. "/app.js", need not be NUL terminated
+ * @param path_len Length of the path
+ * @param entry Filled with the asset if found
+ * @return true if the bundle is open and holds the path
+ */
+bool asset_bundle_find(const char* path, size_t path_len, asset_bundle_entry_t* entry);
+
+#ifdef __cplusplus
+}
+#endif
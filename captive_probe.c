@@ -0,0 +1,139 @@
+#include "captive_probe.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <esp_log.h>
+#include <lwip/inet.h>
+
+static const char* TAG = "esp_wifi_portal";
+
+/*
+    Paths checked first, a string compare each. Hosts are only looked at for other paths, as reading a header costs
+    more than the whole path table.
+*/
+static captive_probe_t probes[] = {
+    {.os = "apple", .path = "/hotspot-detect.html"},
+    {.os = "apple", .path = "/library/test/success.html"},
+    {.os = "android", .path = "/generate_204"},
+    {.os = "android", .path = "/gen_204"},
+    {.os = "windows", .path = "/connecttest.txt"},
+    {.os = "windows", .path = "/ncsi.txt"},
+    {.os = "windows", .path = "/redirect"},
+    {.os = "firefox", .path = "/success.txt"},
+    {.os = "firefox", .path = "/canonical.html"},
+    {.os = "apple", .host = "captive.apple.com"},
+    {.os = "android", .host = "connectivitycheck.gstatic.com"},
+    {.os = "android", .host = "connectivitycheck.android.com"},
+    {.os = "android", .host = "clients3.google.com"},
+    {.os = "windows", .host = "www.msftconnecttest.com"},
+    {.os = "windows", .host = "www.msftncsi.com"},
+    {.os = "firefox", .host = "detectportal.firefox.com"},
+    {.os = "linux", .host = "connectivity-check.ubuntu.com"},
+    {.os = "linux", .host = "nmcheck.gnome.org"},
+};
+
+#define PROBE_COUNT (sizeof(probes) / sizeof(probes[0]))
+
+static char response[256];
+static int response_len = 0;
+
+esp_err_t captive_probe_init(const uint32_t ap_ip)
+{
+    char ip[16];
+    char body[64];
+    inet_ntoa_r(ap_ip, ip, sizeof(ip));
+    const int body_len = snprintf(body, sizeof(body), "<a href=\"http://%s/\">Portal</a>", ip);
+    response_len = snprintf(response, sizeof(response),
+                            "HTTP/1.1 302 Found\r\n"
+                            "Location: http://%s/\r\n"
+                            "Content-Type: text/html\r\n"
+                            "Cache-Control: no-store\r\n"
+                            "Content-Length: %d\r\n"
+                            "\r\n"
+                            "%s",
+                            ip, body_len, body);
+    if (body_len >= sizeof(body) || response_len >= sizeof(response))
+    {
+        response_len = 0;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (int i = 0; i < PROBE_COUNT; i++)
+    {
+        probes[i].hits = 0;
+    }
+    return ESP_OK;
+}
+
+static captive_probe_t* find_probe(httpd_req_t* req)
+{
+    const size_t path_len = strcspn(req->uri, "?");
+    int first_host = PROBE_COUNT;
+    for (int i = 0; i < PROBE_COUNT; i++)
+    {
+        if (probes[i].path == NULL)
+        {
+            first_host = i;
+            break;
+        }
+        if (strncmp(probes[i].path, req->uri, path_len) == 0 && probes[i].path[path_len] == '\0')
+        {
+            return &probes[i];
+        }
+    }
+
+    char host[40];
+    if (httpd_req_get_hdr_value_str(req, "Host", host, sizeof(host)) != ESP_OK)
+    {
+        return NULL;
+    }
+    host[strcspn(host, ":")] = '\0';
+    for (int i = first_host; i < PROBE_COUNT; i++)
+    {
+        if (strcasecmp(probes[i].host, host) == 0)
+        {
+            return &probes[i];
+        }
+    }
+    return NULL;
+}
+
+bool captive_probe_handle(httpd_req_t* req)
+{
+    if (response_len == 0)
+    {
+        return false;
+    }
+    captive_probe_t* probe = find_probe(req);
+    if (probe == NULL)
+    {
+        return false;
+    }
+    // Only the httpd task serves requests, no lock needed
+    probe->hits++;
+    if (httpd_send(req, response, response_len) != response_len)
+    {
+        ESP_LOGD(TAG, "Failed to answer %s probe", probe->os);
+    }
+    return true;
+}
+
+const captive_probe_t* captive_probe_get_table(int* count)
+{
+    *count = PROBE_COUNT;
+    return probes;
+}
+
+void captive_probe_log_stats(void)
+{
+    for (int i = 0; i < PROBE_COUNT; i++)
+    {
+        if (probes[i].hits)
+        {
+            ESP_LOGI(TAG, "Captive probe %s %s: %" PRIu32 " hits", probes[i].os,
+                     probes[i].path ? probes[i].path : probes[i].host, probes[i].hits);
+        }
+    }
+}
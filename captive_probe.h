@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief One known connectivity probe, matched by path or by Host
+ */
+typedef struct captive_probe {
+    const char* os;         /**<! Who sends it, for the stats */
+    const char* path;       /**<! Path without query, NULL to match by host only */
+    const char* host;       /**<! Host header, NULL to match by path only */
+    uint32_t hits;          /**<! Probes answered since captive_probe_init() */
+} captive_probe_t;
+
+/**
+ * @brief Build the probe response for the softAP address and clear the counters
+ *
+ * Must run before the web server starts serving probes.
+ *
+ * @param ap_ip softAP IPv4 address in network byte order, the popup is sent to http://<ap_ip>/
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the response does not fit its buffer
+ */
+esp_err_t captive_probe_init(uint32_t ap_ip);
+
+/**
+ * @brief Answer a request if it is a known OS connectivity probe
+ *
+ * The response is a prebuilt 302 to the portal with a small body. Apple's probe only treats a response with content
+ * as a captive network. It is sent as it is, without logging or formatting anything per request.
+ *
+ * @return true if the request was a probe and got its response
+ */
+bool captive_probe_handle(httpd_req_t* req);
+
+/**
+ * @brief Get the probe table with the hit counters
+ *
+ * @param count Set to the number of probes in the table
+ * @return The table, only to be read
+ */
+const captive_probe_t* captive_probe_get_table(int* count);
+
+/**
+ * @brief Log the probes answered since captive_probe_init()
+ */
+void captive_probe_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,515 @@
+#include "connect_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+    FIELD_NONE,
+    FIELD_SSID,
+    FIELD_PASSWORD,
+    FIELD_BSSID,
+    FIELD_CHANNEL,
+    FIELD_HIDDEN,
+};
+
+enum
+{
+    // JSON
+    J_START,
+    J_FIRST_KEY,
+    J_KEY_START,
+    J_KEY,
+    J_KEY_ESC,
+    J_COLON,
+    J_VALUE,
+    J_STR,
+    J_STR_ESC,
+    J_STR_HEX,
+    J_LIT,
+    J_AFTER,
+    J_DONE,
+    // urlencoded
+    F_KEY,
+    F_VALUE,
+};
+
+static const struct
+{
+    const char* key;
+    uint8_t field;
+} fields[] = {
+    {"ssid", FIELD_SSID},
+    {"password", FIELD_PASSWORD},
+    {"bssid", FIELD_BSSID},
+    {"channel", FIELD_CHANNEL},
+    {"hidden", FIELD_HIDDEN},
+};
+
+static bool is_space(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int hex_value(const char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void fail(connect_parser_t* p, const esp_err_t err)
+{
+    if (p->err == ESP_OK)
+    {
+        p->err = err;
+    }
+}
+
+static void key_put(connect_parser_t* p, const char c)
+{
+    if (p->key_len < sizeof(p->key) - 1)
+    {
+        p->key[p->key_len++] = c;
+    }
+    else
+    {
+        p->key_len = sizeof(p->key);
+    }
+}
+
+static void value_begin(connect_parser_t* p)
+{
+    p->field = FIELD_NONE;
+    if (p->key_len < sizeof(p->key))
+    {
+        p->key[p->key_len] = '\0';
+        for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        {
+            if (strcmp(p->key, fields[i].key) == 0)
+            {
+                p->field = fields[i].field;
+                break;
+            }
+        }
+    }
+    p->key_len = 0;
+    p->value_len = 0;
+    if (p->field == FIELD_SSID)
+    {
+        memset(p->sta->ssid, 0, sizeof(p->sta->ssid));
+    }
+    else if (p->field == FIELD_PASSWORD)
+    {
+        memset(p->sta->password, 0, sizeof(p->sta->password));
+    }
+}
+
+static void value_put(connect_parser_t* p, const uint8_t c)
+{
+    uint8_t* dst;
+    size_t cap;
+    switch (p->field)
+    {
+    case FIELD_NONE:
+        return;
+    case FIELD_SSID:
+        dst = p->sta->ssid;
+        cap = sizeof(p->sta->ssid);
+        break;
+    case FIELD_PASSWORD:
+        dst = p->sta->password;
+        cap = sizeof(p->sta->password);
+        break;
+    default:
+        dst = (uint8_t*)p->scratch;
+        cap = sizeof(p->scratch) - 1;
+        break;
+    }
+    if (p->value_len == cap)
+    {
+        fail(p, p->field == FIELD_SSID || p->field == FIELD_PASSWORD ? ESP_ERR_INVALID_SIZE : ESP_ERR_INVALID_ARG);
+        return;
+    }
+    dst[p->value_len++] = c;
+}
+
+/* Code point of a \u escape as UTF-8 */
+static void value_put_utf8(connect_parser_t* p, const uint16_t cp)
+{
+    if (cp < 0x80)
+    {
+        value_put(p, cp);
+    }
+    else if (cp < 0x800)
+    {
+        value_put(p, 0xC0 | (cp >> 6));
+        value_put(p, 0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        value_put(p, 0xE0 | (cp >> 12));
+        value_put(p, 0x80 | ((cp >> 6) & 0x3F));
+        value_put(p, 0x80 | (cp & 0x3F));
+    }
+}
+
+static bool parse_bssid(const char* str, uint8_t bssid[6])
+{
+    int end = 0;
+    return sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n", &bssid[0], &bssid[1], &bssid[2], &bssid[3],
+                  &bssid[4], &bssid[5], &end) == 6 && end == 17 && str[end] == '\0';
+}
+
+static void value_end(connect_parser_t* p)
+{
+    p->scratch[p->field >= FIELD_BSSID ? p->value_len : 0] = '\0';
+    switch (p->field)
+    {
+    case FIELD_SSID:
+        p->has_ssid = p->value_len > 0;
+        break;
+    case FIELD_BSSID:
+        // An empty value, e.g. from a form field left blank, means any BSS
+        p->sta->bssid_set = p->value_len > 0;
+        if (p->value_len > 0 && !parse_bssid(p->scratch, p->sta->bssid))
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    case FIELD_CHANNEL:
+    {
+        char* end;
+        const unsigned long channel = strtoul(p->scratch, &end, 10);
+        if (*end != '\0' || channel > 196)
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        p->sta->channel = channel;
+        break;
+    }
+    case FIELD_HIDDEN:
+        if (strcmp(p->scratch, "true") == 0 || strcmp(p->scratch, "1") == 0 || strcmp(p->scratch, "on") == 0)
+        {
+            p->hidden = true;
+        }
+        else if (strcmp(p->scratch, "false") == 0 || strcmp(p->scratch, "0") == 0 || p->value_len == 0)
+        {
+            p->hidden = false;
+        }
+        else
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    default:
+        break;
+    }
+    p->field = FIELD_NONE;
+}
+
+/*
+    One byte of a JSON object with string, number and literal values. Nested objects and arrays are not expected in a
+    connect request and are rejected.
+*/
+static void json_step(connect_parser_t* p, const char c)
+{
+    switch (p->state)
+    {
+    case J_START:
+        if (c == '{')
+        {
+            p->state = J_FIRST_KEY;
+        }
+        else if (!is_space(c))
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    case J_FIRST_KEY:
+        if (c == '}')
+        {
+            p->state = J_DONE;
+            break;
+        }
+        // fallthrough
+    case J_KEY_START:
+        if (c == '"')
+        {
+            p->state = J_KEY;
+        }
+        else if (!is_space(c))
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    case J_KEY:
+        if (c == '"')
+        {
+            p->state = J_COLON;
+        }
+        else if (c == '\\')
+        {
+            // None of the known keys needs escaping, so an escaped key is an unknown one
+            p->key_len = sizeof(p->key);
+            p->state = J_KEY_ESC;
+        }
+        else
+        {
+            key_put(p, c);
+        }
+        break;
+    case J_KEY_ESC:
+        p->state = J_KEY;
+        break;
+    case J_COLON:
+        if (c == ':')
+        {
+            p->state = J_VALUE;
+        }
+        else if (!is_space(c))
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    case J_VALUE:
+        if (is_space(c))
+        {
+            break;
+        }
+        value_begin(p);
+        if (c == '"')
+        {
+            p->state = J_STR;
+        }
+        else if ((c >= '0' && c <= '9') || c == '-' || (c >= 'a' && c <= 'z'))
+        {
+            // Numbers and true/false/null, only valid for the fields converted from text
+            if (p->field == FIELD_SSID || p->field == FIELD_PASSWORD)
+            {
+                fail(p, ESP_ERR_INVALID_ARG);
+            }
+            value_put(p, c);
+            p->state = J_LIT;
+        }
+        else
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    case J_STR:
+        if (c == '"')
+        {
+            value_end(p);
+            p->state = J_AFTER;
+        }
+        else if (c == '\\')
+        {
+            p->state = J_STR_ESC;
+        }
+        else if ((uint8_t)c < 0x20)
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        else
+        {
+            value_put(p, c);
+        }
+        break;
+    case J_STR_ESC:
+    {
+        static const char escaped[] = "\"\\/bfnrt";
+        static const char unescaped[] = "\"\\/\b\f\n\r\t";
+        const char* esc = c != '\0' ? strchr(escaped, c) : NULL;
+        p->state = J_STR;
+        if (esc != NULL)
+        {
+            value_put(p, unescaped[esc - escaped]);
+        }
+        else if (c == 'u')
+        {
+            p->hex = 0;
+            p->hex_len = 0;
+            p->state = J_STR_HEX;
+        }
+        else
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    }
+    case J_STR_HEX:
+    {
+        const int digit = hex_value(c);
+        if (digit < 0)
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+            break;
+        }
+        p->hex = (p->hex << 4) | digit;
+        if (++p->hex_len == 4)
+        {
+            // Browsers only escape control characters, surrogate pairs are not worth decoding here
+            if (p->hex >= 0xD800 && p->hex <= 0xDFFF)
+            {
+                fail(p, ESP_ERR_INVALID_ARG);
+            }
+            value_put_utf8(p, p->hex);
+            p->state = J_STR;
+        }
+        break;
+    }
+    case J_LIT:
+        if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '.' || c == '-' || c == '+' || c == 'E')
+        {
+            value_put(p, c);
+            break;
+        }
+        value_end(p);
+        p->state = J_AFTER;
+        // fallthrough
+    case J_AFTER:
+        if (c == ',')
+        {
+            p->state = J_KEY_START;
+        }
+        else if (c == '}')
+        {
+            p->state = J_DONE;
+        }
+        else if (!is_space(c))
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    case J_DONE:
+        if (!is_space(c))
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+        break;
+    default:
+        fail(p, ESP_ERR_INVALID_ARG);
+        break;
+    }
+}
+
+/* One decoded byte of a form key or value */
+static void form_put(connect_parser_t* p, const uint8_t c)
+{
+    if (p->state == F_KEY)
+    {
+        key_put(p, c);
+    }
+    else
+    {
+        value_put(p, c);
+    }
+}
+
+static void form_step(connect_parser_t* p, const char c)
+{
+    if (p->hex_len > 0)
+    {
+        const int digit = hex_value(c);
+        if (digit < 0)
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+            return;
+        }
+        p->hex = (p->hex << 4) | digit;
+        if (++p->hex_len == 3)
+        {
+            p->hex_len = 0;
+            form_put(p, p->hex);
+        }
+        return;
+    }
+
+    if (c == '%')
+    {
+        p->hex = 0;
+        p->hex_len = 1;
+    }
+    else if (c == '+')
+    {
+        form_put(p, ' ');
+    }
+    else if (c == '=' && p->state == F_KEY)
+    {
+        value_begin(p);
+        p->state = F_VALUE;
+    }
+    else if (c == '&')
+    {
+        // A key without '=' has an empty value
+        if (p->state == F_KEY)
+        {
+            value_begin(p);
+        }
+        value_end(p);
+        p->state = F_KEY;
+    }
+    else
+    {
+        form_put(p, c);
+    }
+}
+
+void connect_parser_init(connect_parser_t* p, const connect_parser_format_t format, wifi_sta_config_t* sta)
+{
+    memset(p, 0, sizeof(*p));
+    p->format = format;
+    p->sta = sta;
+    p->state = format == CONNECT_PARSER_FORM ? F_KEY : J_START;
+    memset(sta->ssid, 0, sizeof(sta->ssid));
+    memset(sta->password, 0, sizeof(sta->password));
+    memset(sta->bssid, 0, sizeof(sta->bssid));
+    sta->bssid_set = false;
+    sta->channel = 0;
+}
+
+esp_err_t connect_parser_feed(connect_parser_t* p, const char* data, const size_t len)
+{
+    for (size_t i = 0; i < len && p->err == ESP_OK; i++)
+    {
+        if (p->format == CONNECT_PARSER_FORM)
+        {
+            form_step(p, data[i]);
+        }
+        else
+        {
+            json_step(p, data[i]);
+        }
+    }
+    return p->err;
+}
+
+esp_err_t connect_parser_finish(connect_parser_t* p)
+{
+    if (p->err == ESP_OK)
+    {
+        if (p->format == CONNECT_PARSER_FORM)
+        {
+            if (p->hex_len > 0)
+            {
+                fail(p, ESP_ERR_INVALID_ARG);
+            }
+            else if (p->state == F_VALUE || p->key_len > 0)
+            {
+                form_step(p, '&');
+            }
+        }
+        else if (p->state != J_DONE)
+        {
+            fail(p, ESP_ERR_INVALID_ARG);
+        }
+    }
+    if (p->err == ESP_OK && !p->has_ssid)
+    {
+        p->err = ESP_ERR_NOT_FOUND;
+    }
+    return p->err;
+}
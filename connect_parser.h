@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONNECT_PARSER_KEY_MAX 12
+#define CONNECT_PARSER_SCRATCH_MAX 18
+
+typedef enum {
+    CONNECT_PARSER_JSON,    /**<! application/json object */
+    CONNECT_PARSER_FORM,    /**<! application/x-www-form-urlencoded */
+} connect_parser_format_t;
+
+/**
+ * @brief Allocation-free parser of the /connect request body
+ *
+ * The body is fed in pieces as it arrives and the fields are written straight into the station config:
+ * `ssid` (up to 32 bytes), `password` (up to 64 bytes), `bssid` ("aa:bb:cc:dd:ee:ff"), `channel` and `hidden`
+ * (true/false, 1/0 or a checkbox "on"). Unknown fields are skipped, the last of repeated fields wins. The first
+ * error is latched and all later input is ignored.
+ */
+typedef struct connect_parser {
+    connect_parser_format_t format;
+    wifi_sta_config_t* sta;
+    bool hidden;                /**<! The network does not broadcast its SSID, it is not expected in the scan */
+    bool has_ssid;
+    esp_err_t err;
+    uint8_t state;
+    uint8_t field;              /**<! Field the current value is written to */
+    uint8_t hex_len;            /**<! Hex digits of a \u or %XX escape read so far */
+    uint16_t hex;
+    size_t value_len;
+    char key[CONNECT_PARSER_KEY_MAX];
+    size_t key_len;             /**<! sizeof(key) for a key too long to be known */
+    char scratch[CONNECT_PARSER_SCRATCH_MAX];   /**<! Text of a value that is converted once complete */
+} connect_parser_t;
+
+/**
+ * @brief Start parsing a body, clearing the SSID, password, BSSID and channel of `sta`
+ */
+void connect_parser_init(connect_parser_t* p, connect_parser_format_t format, wifi_sta_config_t* sta);
+
+/**
+ * @brief Parse the next piece of the body
+ *
+ * @return ESP_OK so far, ESP_ERR_INVALID_SIZE for a value that does not fit its field, ESP_ERR_INVALID_ARG for
+ *         malformed input
+ */
+esp_err_t connect_parser_feed(connect_parser_t* p, const char* data, size_t len);
+
+/**
+ * @brief End of the body, checks it was complete and held an SSID
+ *
+ * @return ESP_OK on success, the latched error otherwise, ESP_ERR_NOT_FOUND without an SSID
+ */
+esp_err_t connect_parser_finish(connect_parser_t* p);
+
+#ifdef __cplusplus
+}
+#endif
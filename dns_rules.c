@@ -0,0 +1,267 @@
+#include "dns_rules.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define NO_RULE (-1)
+#define ROOT_NODE 0
+
+// Hashed trie edge: the child of `parent` reached by `label`. Slots with child == ROOT_NODE are free.
+typedef struct dns_rule_edge {
+    const char* label;
+    uint16_t label_len;
+    uint16_t parent;
+    uint16_t child;
+} dns_rule_edge_t;
+
+struct dns_rules {
+    const dns_entry_pair_t* entries;
+    int16_t* exact;             // Exact names, open addressing, rule index or NO_RULE
+    size_t exact_mask;
+    dns_rule_edge_t* edges;     // Trie edges, open addressing
+    size_t edges_mask;
+    int16_t* node_rule;         // `*.suffix` rule ending at each node, node_rule[ROOT_NODE] is the "*" rule
+    uint16_t node_count;
+};
+
+/*
+    FNV-1a over the lowercased bytes
+*/
+static uint32_t hash_lower(uint32_t hash, const char* str, const size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)tolower((unsigned char)str[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_edge(const uint16_t parent, const char* label, const size_t len)
+{
+    return hash_lower(2166136261u ^ (parent * 2654435761u), label, len);
+}
+
+static size_t table_size(const size_t count)
+{
+    // At most half full, so probe sequences stay short
+    size_t size = 8;
+    while (size < count * 2)
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+/*
+    Find the label that ends at `end` (exclusive) in a dot separated name, returns its start
+*/
+static const char* label_start(const char* name, const char* end)
+{
+    const char* start = end;
+    while (start > name && start[-1] != '.')
+    {
+        start--;
+    }
+    return start;
+}
+
+static uint16_t find_child(const dns_rules_t* rules, const uint16_t parent, const char* label, const size_t len)
+{
+    for (size_t slot = hash_edge(parent, label, len) & rules->edges_mask;; slot = (slot + 1) & rules->edges_mask)
+    {
+        const dns_rule_edge_t* edge = &rules->edges[slot];
+        if (edge->child == ROOT_NODE)
+        {
+            return ROOT_NODE;
+        }
+        if (edge->parent == parent && edge->label_len == len && strncasecmp(edge->label, label, len) == 0)
+        {
+            return edge->child;
+        }
+    }
+}
+
+static uint16_t add_child(dns_rules_t* rules, const uint16_t parent, const char* label, const size_t len)
+{
+    size_t slot = hash_edge(parent, label, len) & rules->edges_mask;
+    for (;; slot = (slot + 1) & rules->edges_mask)
+    {
+        const dns_rule_edge_t* edge = &rules->edges[slot];
+        if (edge->child == ROOT_NODE)
+        {
+            break;
+        }
+        if (edge->parent == parent && edge->label_len == len && strncasecmp(edge->label, label, len) == 0)
+        {
+            return edge->child;
+        }
+    }
+    const uint16_t child = rules->node_count++;
+    rules->edges[slot] = (dns_rule_edge_t){
+        .label = label,
+        .label_len = (uint16_t)len,
+        .parent = parent,
+        .child = child
+    };
+    return child;
+}
+
+static void add_exact(dns_rules_t* rules, const int index)
+{
+    const char* name = rules->entries[index].name;
+    const size_t len = strlen(name);
+    for (size_t slot = hash_lower(2166136261u, name, len) & rules->exact_mask;;
+         slot = (slot + 1) & rules->exact_mask)
+    {
+        if (rules->exact[slot] == NO_RULE)
+        {
+            rules->exact[slot] = (int16_t)index;
+            return;
+        }
+        if (strcasecmp(rules->entries[rules->exact[slot]].name, name) == 0)
+        {
+            // Duplicate, the first rule counts
+            return;
+        }
+    }
+}
+
+static void add_wildcard(dns_rules_t* rules, const int index)
+{
+    // Skip the "*." and insert the suffix labels right to left
+    const char* suffix = rules->entries[index].name + 2;
+    uint16_t node = ROOT_NODE;
+    const char* end = suffix + strlen(suffix);
+    while (end > suffix)
+    {
+        const char* start = label_start(suffix, end);
+        node = add_child(rules, node, start, end - start);
+        end = start > suffix ? start - 1 : suffix;
+    }
+    if (rules->node_rule[node] == NO_RULE)
+    {
+        rules->node_rule[node] = (int16_t)index;
+    }
+}
+
+static bool is_wildcard(const char* name)
+{
+    return name[0] == '*' && name[1] == '.' && name[2] != '\0';
+}
+
+dns_rules_t* dns_rules_build(const dns_entry_pair_t* entries, const int count)
+{
+    size_t exact_count = 0;
+    size_t label_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const char* name = entries[i].name;
+        if (is_wildcard(name))
+        {
+            label_count++;
+            for (const char* c = name + 2; *c; c++)
+            {
+                label_count += *c == '.';
+            }
+        }
+        else if (strcmp(name, "*") != 0)
+        {
+            exact_count++;
+        }
+    }
+
+    dns_rules_t* rules = calloc(1, sizeof(dns_rules_t));
+    if (rules == NULL)
+    {
+        return NULL;
+    }
+    rules->entries = entries;
+    rules->exact_mask = table_size(exact_count) - 1;
+    rules->edges_mask = table_size(label_count) - 1;
+    rules->exact = malloc((rules->exact_mask + 1) * sizeof(int16_t));
+    rules->edges = calloc(rules->edges_mask + 1, sizeof(dns_rule_edge_t));
+    rules->node_rule = malloc((label_count + 1) * sizeof(int16_t));
+    if (!rules->exact || !rules->edges || !rules->node_rule)
+    {
+        dns_rules_free(rules);
+        return NULL;
+    }
+    memset(rules->exact, 0xff, (rules->exact_mask + 1) * sizeof(int16_t));
+    memset(rules->node_rule, 0xff, (label_count + 1) * sizeof(int16_t));
+    rules->node_count = 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        const char* name = entries[i].name;
+        if (strcmp(name, "*") == 0)
+        {
+            if (rules->node_rule[ROOT_NODE] == NO_RULE)
+            {
+                rules->node_rule[ROOT_NODE] = (int16_t)i;
+            }
+        }
+        else if (is_wildcard(name))
+        {
+            add_wildcard(rules, i);
+        }
+        else
+        {
+            add_exact(rules, i);
+        }
+    }
+    return rules;
+}
+
+void dns_rules_free(dns_rules_t* rules)
+{
+    if (rules)
+    {
+        free(rules->exact);
+        free(rules->edges);
+        free(rules->node_rule);
+        free(rules);
+    }
+}
+
+int dns_rules_match(const dns_rules_t* rules, const char* name)
+{
+    const size_t len = strlen(name);
+    for (size_t slot = hash_lower(2166136261u, name, len) & rules->exact_mask;;
+         slot = (slot + 1) & rules->exact_mask)
+    {
+        const int16_t index = rules->exact[slot];
+        if (index == NO_RULE)
+        {
+            break;
+        }
+        if (strcasecmp(rules->entries[index].name, name) == 0)
+        {
+            return index;
+        }
+    }
+
+    // Walk the reversed labels, remembering the deepest `*.suffix` rule. A wildcard only covers names below its
+    // suffix, so the rule of the node reached by the full name does not count.
+    int match = rules->node_rule[ROOT_NODE];
+    uint16_t node = ROOT_NODE;
+    const char* end = name + len;
+    while (end > name)
+    {
+        const char* start = label_start(name, end);
+        node = find_child(rules, node, start, end - start);
+        if (node == ROOT_NODE || start == name)
+        {
+            break;
+        }
+        if (rules->node_rule[node] != NO_RULE)
+        {
+            match = rules->node_rule[node];
+        }
+        end = start - 1;
+    }
+    return match;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "esp_netif.h"
+#include "dns_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Compiled index over the rules of a DNS server config
+ *
+ * Exact names go into a hash table, `*.suffix` rules into a trie of reversed labels whose edges are hashed as well,
+ * so a lookup costs a few hash probes per label of the queried name regardless of the number of rules.
+ */
+typedef struct dns_rules dns_rules_t;
+
+/**
+ * @brief Build the index
+ *
+ * @param entries Rules, must stay valid as long as the index is used (names are referenced, not copied)
+ * @param count Number of rules
+ * @return The index, NULL if out of memory
+ */
+dns_rules_t* dns_rules_build(const dns_entry_pair_t* entries, int count);
+
+void dns_rules_free(dns_rules_t* rules);
+
+/**
+ * @brief Find the rule answering a name
+ *
+ * An exact rule wins over the longest matching `*.suffix` rule, which wins over `*`. Names are compared
+ * case-insensitively. Of duplicate rules the first one counts.
+ *
+ * @param rules Index
+ * @param name Queried name, dot separated without a trailing dot
+ * @return Index of the rule in the config, -1 if no rule matches
+ */
+int dns_rules_match(const dns_rules_t* rules, const char* name);
+
+#ifdef __cplusplus
+}
+#endif
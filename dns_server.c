@@ -6,25 +6,53 @@
 
 #include <sys/param.h>
 #include <inttypes.h>
+#include <stddef.h>
 
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_check.h"
+#include "esp_event.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include "lwip/netdb.h"
+#include "lwip/udp.h"
+#include "lwip/priv/tcpip_priv.h"
 #include "dns_server.h"
+#include "dns_rules.h"
 
+#ifndef DNS_PORT
 #define DNS_PORT (53)
-#define DNS_MAX_LEN (256)
+#endif
+// Without EDNS in the replies, clients expect no more than the classic UDP limit
+#define DNS_MAX_LEN (512)
+// Datagrams taken from the socket per wakeup
+#define DNS_BATCH (4)
+// Longest the task sleeps without looking at the stop flag, in case the wake-up datagram gets lost
+#define DNS_POLL_MS (1000)
+
+// Header flags, host byte order
+#define QR_FLAG (1 << 15)
+#define OPCODE_MASK (0xF << 11)
+#define AA_FLAG (1 << 10)
+#define RD_FLAG (1 << 8)
+#define RCODE_NOTIMP (4)
+#define RCODE_REFUSED (5)
 
-#define OPCODE_MASK (0x7800)
-#define QR_FLAG (1 << 7)
 #define QD_TYPE_A (0x0001)
+#define QD_TYPE_SOA (0x0006)
+#define QD_TYPE_AAAA (0x001C)
+#define QD_CLASS_IN (0x0001)
 #define ANS_TTL_SEC (300)
+#define NEGATIVE_TTL_SEC (60)
+#define DNS_RATE_CLIENTS (8)
+
+// Compression pointer to the first question's name
+#define FIRST_NAME_PTR (0xC000 | sizeof(dns_header_t))
 
 static const char* TAG = "esp_wifi_portal";
 
@@ -57,15 +85,91 @@ typedef struct __attribute__((__packed__))
     uint32_t ip_addr;
 } dns_answer_t;
 
+// DNS AAAA Answer Packet
+typedef struct __attribute__((__packed__))
+{
+    uint16_t ptr_offset;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t addr_len;
+    uint8_t ip6_addr[16];
+} dns_answer6_t;
+
+// SOA record of a NODATA reply, both names point at the question
+typedef struct __attribute__((__packed__))
+{
+    uint16_t ptr_offset;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t data_len;
+    uint16_t mname_ptr;
+    uint16_t rname_ptr;
+    uint32_t serial;
+    uint32_t refresh;
+    uint32_t retry;
+    uint32_t expire;
+    uint32_t minimum;
+} dns_soa_t;
+
+// Returned by answer_wildcard() for packets the fast path does not cover
+#define DNS_NOT_HANDLED (-2)
+
+// Token bucket of one source address, tokens are counted in thousandths of a query
+typedef struct
+{
+    uint8_t addr[16];   // Source address, IPv4 in its IPv4-mapped IPv6 form
+    uint32_t last_ms;   // Time of the last refill, 0 for an unused slot
+    uint32_t tokens;
+} dns_client_bucket_t;
+
+// One datagram of a batch, the reply is built in place in `rx` or in `tx`
+typedef struct
+{
+    struct sockaddr_in6 addr;   // Large enough for both IPv4 or IPv6
+    socklen_t addr_len;
+    int len;                    // Length received, then length of the reply, <= 0 for no reply
+    const char* reply;
+    char rx[DNS_MAX_LEN + 1];   // Room to NUL-terminate
+    char tx[DNS_MAX_LEN];
+} dns_slot_t;
+
 // DNS server handle
 struct dns_server_handle
 {
-    bool started;
+    volatile bool started;
     TaskHandle_t task;
+    SemaphoreHandle_t stopped;      // Given by the task right before it exits
+    int ctrl_sock;                  // Loopback socket, a datagram to it wakes the task up to see the stop flag
+    struct sockaddr_in ctrl_addr;
+    struct udp_pcb* pcb;            // Raw PCB served from the tcpip thread instead of the task, see `in_tcpip_task`
+    bool wildcard_only;             // The only rule is "*", every A question gets the same answer
+    dns_answer_t wildcard_answer;   // Prebuilt answer for the fast path, only the address is filled per packet
+    dns_soa_t nodata_soa;           // Prebuilt authority record of NODATA replies
+    dns_rules_t* rules;             // Index over `entry` for the general path
+    esp_event_handler_instance_t ip_event_instance;
+    uint32_t* entry_addr;           // Answer of each rule, netif addresses are cached and refreshed on IP events
+    esp_ip6_addr_t* entry_addr6;    // AAAA answer of each rule, all zero if there is none
+    portMUX_TYPE addr6_lock;        // An IPv6 address is not written atomically
+    uint32_t rate_limit;            // Queries per second per source, 0 for no limit
+    uint32_t rate_burst;            // Bucket size in thousandths of a query
+    bool refuse_over_limit;         // Answer queries over the limit with REFUSED instead of dropping them
+    int num_of_clients;
+    dns_client_bucket_t* clients;   // Fixed table, the least recently seen source is replaced when it is full
+    dns_server_stats_t stats;       // Only written by the DNS task
+    dns_slot_t* slots;              // DNS_BATCH datagrams, kept off the task stack
+    dns_server_handle_t next;       // In `servers`, protected by servers_lock
+    int refreshing;                 // IP event handlers running on this handle, protected by servers_lock
     int num_of_entries;
     dns_entry_pair_t entry[];
 };
 
+// Servers the IP event handler may refresh. Unregistering the handler does not wait for one that is already running,
+// so the handler only touches a handle it finds here, and stop waits until it is done with it.
+static portMUX_TYPE servers_lock = portMUX_INITIALIZER_UNLOCKED;
+static dns_server_handle_t servers = NULL;
+
 /*
     Parse the name from the packet from the DNS name format to a regular .-seperated name
     returns the pointer to the next part of the packet
@@ -100,17 +204,354 @@ static char* parse_dns_name(char* raw_name, char* parsed_name, size_t parsed_nam
     return label + 1;
 }
 
-// Parses the DNS request and prepares a DNS response with the IP of the softAP
+#if CONFIG_LWIP_IPV6
+/*
+    Pick the IPv6 address of a netif to answer AAAA with: a unique local or global one. Clients cannot use a link-local
+    address without a zone, a browser would try it and stall before falling back to IPv4, so with only a link-local
+    address AAAA gets NODATA.
+*/
+static void get_netif_ip6(esp_netif_t* netif, esp_ip6_addr_t* out)
+{
+    esp_ip6_addr_t addrs[LWIP_IPV6_NUM_ADDRESSES];
+    const int count = esp_netif_get_all_ip6(netif, addrs);
+    for (int i = 0; i < count; i++)
+    {
+        const esp_ip6_addr_type_t type = esp_netif_ip6_get_addr_type(&addrs[i]);
+        if (type == ESP_IP6_ADDR_IS_UNIQUE_LOCAL || type == ESP_IP6_ADDR_IS_GLOBAL)
+        {
+            *out = addrs[i];
+            return;
+        }
+    }
+}
+#endif // CONFIG_LWIP_IPV6
+
+/*
+    Resolve the address of every rule. Runs at start and on IP events, so the reply path never touches netif.
+*/
+static void refresh_entry_addrs(const dns_server_handle_t h)
+{
+    for (int i = 0; i < h->num_of_entries; i++)
+    {
+        const dns_entry_pair_t* entry = &h->entry[i];
+        uint32_t addr = entry->ip.addr;
+        esp_ip6_addr_t addr6 = entry->ip6;
+        if (entry->if_key)
+        {
+            esp_netif_ip_info_t ip_info = {0};
+            esp_netif_t* netif = esp_netif_get_handle_from_ifkey(entry->if_key);
+            if (netif == NULL || esp_netif_get_ip_info(netif, &ip_info) != ESP_OK)
+            {
+                ESP_LOGW(TAG, "No IP for DNS rule %s on %s", entry->name, entry->if_key);
+            }
+            addr = ip_info.ip.addr;
+            memset(&addr6, 0, sizeof(addr6));
+#if CONFIG_LWIP_IPV6
+            if (netif != NULL)
+            {
+                get_netif_ip6(netif, &addr6);
+            }
+#endif
+        }
+        // A single aligned word, the DNS task reads it without a lock
+        h->entry_addr[i] = addr;
+        taskENTER_CRITICAL(&h->addr6_lock);
+        h->entry_addr6[i] = addr6;
+        taskEXIT_CRITICAL(&h->addr6_lock);
+    }
+}
+
+/*
+    Copy the AAAA answer of a rule, returns false if the rule has none
+*/
+static bool get_entry_addr6(const dns_server_handle_t h, const int index, uint8_t out[16])
+{
+    taskENTER_CRITICAL(&h->addr6_lock);
+    memcpy(out, h->entry_addr6[index].addr, 16);
+    taskEXIT_CRITICAL(&h->addr6_lock);
+    static const uint8_t unspecified[16] = {0};
+    return memcmp(out, unspecified, 16) != 0;
+}
+
+/*
+    Append the answer of `rule` to a question of type A or AAAA at `*len`. Returns 1 if an answer was appended, 0 if
+    the rule has no address of that type, -1 if the reply does not fit.
+*/
+static int append_answer(char* reply, size_t* len, const size_t max_len, const dns_server_handle_t h,
+                         const int rule, const uint16_t qd_type, const uint16_t qd_offset)
+{
+    if (qd_type == QD_TYPE_A)
+    {
+        if (h->entry_addr[rule] == IPADDR_ANY)
+        {
+            return 0;
+        }
+        if (*len + sizeof(dns_answer_t) > max_len)
+        {
+            return -1;
+        }
+        dns_answer_t* answer = (dns_answer_t*)(reply + *len);
+        memcpy(answer, &h->wildcard_answer, sizeof(*answer));
+        answer->ptr_offset = htons(0xC000 | qd_offset);
+        answer->ip_addr = h->entry_addr[rule];
+        *len += sizeof(dns_answer_t);
+        return 1;
+    }
+
+    uint8_t addr6[16];
+    if (!get_entry_addr6(h, rule, addr6))
+    {
+        return 0;
+    }
+    if (*len + sizeof(dns_answer6_t) > max_len)
+    {
+        return -1;
+    }
+    dns_answer6_t* answer = (dns_answer6_t*)(reply + *len);
+    memcpy(answer, &h->wildcard_answer, offsetof(dns_answer6_t, addr_len));
+    answer->ptr_offset = htons(0xC000 | qd_offset);
+    answer->type = htons(QD_TYPE_AAAA);
+    answer->addr_len = htons(sizeof(answer->ip6_addr));
+    memcpy(answer->ip6_addr, addr6, sizeof(answer->ip6_addr));
+    *len += sizeof(dns_answer6_t);
+    return 1;
+}
+
+/*
+    Key the rate limit on the source address, IPv4 sources are stored in their IPv4-mapped form
+*/
+static void source_key(const struct sockaddr_in6* source, uint8_t key[16])
+{
+    if (source->sin6_family == AF_INET)
+    {
+        const struct sockaddr_in* source4 = (const struct sockaddr_in*)source;
+        memset(key, 0, 10);
+        key[10] = 0xFF;
+        key[11] = 0xFF;
+        memcpy(key + 12, &source4->sin_addr.s_addr, 4);
+    }
+    else
+    {
+        memcpy(key, &source->sin6_addr, 16);
+    }
+}
+
+/*
+    Take a token from the bucket of `source`, returns false if the source is over its limit
+*/
+static bool take_token(const dns_server_handle_t h, const struct sockaddr_in6* source)
+{
+    if (h->rate_limit == 0)
+    {
+        return true;
+    }
+    uint8_t key[16];
+    source_key(source, key);
+    // 0 marks an unused slot
+    const uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000) | 1;
+
+    dns_client_bucket_t* bucket = NULL;
+    dns_client_bucket_t* oldest = &h->clients[0];
+    for (int i = 0; i < h->num_of_clients; i++)
+    {
+        dns_client_bucket_t* b = &h->clients[i];
+        if (b->last_ms != 0 && memcmp(b->addr, key, sizeof(key)) == 0)
+        {
+            bucket = b;
+            break;
+        }
+        if (oldest->last_ms != 0 && (b->last_ms == 0 || (int32_t)(b->last_ms - oldest->last_ms) < 0))
+        {
+            oldest = b;
+        }
+    }
+    if (bucket == NULL)
+    {
+        bucket = oldest;
+        memcpy(bucket->addr, key, sizeof(key));
+        bucket->last_ms = now_ms;
+        bucket->tokens = h->rate_burst;
+    }
+
+    // rate_limit queries per second are rate_limit thousandths per millisecond
+    const uint64_t refill = (uint64_t)(now_ms - bucket->last_ms) * h->rate_limit;
+    bucket->tokens = (uint32_t)MIN(bucket->tokens + refill, h->rate_burst);
+    bucket->last_ms = now_ms;
+    if (bucket->tokens < 1000)
+    {
+        return false;
+    }
+    bucket->tokens -= 1000;
+    return true;
+}
+
+static void dns_ip_event_handler(void* arg, const esp_event_base_t event_base, const int32_t event_id,
+                                 void* event_data)
+{
+    // The server may have been stopped and freed meanwhile, `arg` is only compared until it is found
+    const dns_server_handle_t h = arg;
+    bool live = false;
+    taskENTER_CRITICAL(&servers_lock);
+    for (dns_server_handle_t s = servers; s != NULL; s = s->next)
+    {
+        if (s == h)
+        {
+            h->refreshing++;
+            live = true;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&servers_lock);
+    if (!live)
+    {
+        return;
+    }
+
+    // Any address change (STA got/lost IP, softAP lease handed out, IPv6) may affect a rule's netif
+    refresh_entry_addrs(h);
+
+    taskENTER_CRITICAL(&servers_lock);
+    h->refreshing--;
+    taskEXIT_CRITICAL(&servers_lock);
+}
+
+/*
+    Take the server off the IP events and wait for a handler still refreshing it. Called from the event loop task
+    itself, e.g. by the portal's delayed stop, no handler can be running and this does not wait.
+*/
+static void unlink_server(const dns_server_handle_t handle)
+{
+    if (handle->ip_event_instance)
+    {
+        esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID, handle->ip_event_instance);
+        handle->ip_event_instance = NULL;
+    }
+    taskENTER_CRITICAL(&servers_lock);
+    for (dns_server_handle_t* s = &servers; *s != NULL; s = &(*s)->next)
+    {
+        if (*s == handle)
+        {
+            *s = handle->next;
+            break;
+        }
+    }
+    bool busy = handle->refreshing > 0;
+    taskEXIT_CRITICAL(&servers_lock);
+    while (busy)
+    {
+        vTaskDelay(1);
+        taskENTER_CRITICAL(&servers_lock);
+        busy = handle->refreshing > 0;
+        taskEXIT_CRITICAL(&servers_lock);
+    }
+}
+
+/*
+    Returns the offset right after the name starting at `pos`, 0 if the name is malformed or runs past the packet.
+    Queries carry no compression pointers.
+*/
+static size_t skip_dns_name(const char* packet, size_t pos, const size_t len)
+{
+    while (pos < len && packet[pos] != 0)
+    {
+        if ((packet[pos] & 0xC0) != 0)
+        {
+            return 0;
+        }
+        pos += (uint8_t)packet[pos] + 1;
+    }
+    return pos < len ? pos + 1 : 0;
+}
+
+/*
+    Turn the header of a request into the header of its reply, keeping the RD flag as RFC 1035 asks
+*/
+static void set_reply_header(dns_header_t* header, const uint16_t an_count, const uint16_t ns_count)
+{
+    header->flags = htons(QR_FLAG | AA_FLAG | (ntohs(header->flags) & RD_FLAG));
+    header->an_count = htons(an_count);
+    header->ns_count = htons(ns_count);
+    header->ar_count = 0;
+}
+
+/*
+    Reply with just the header and an error code, e.g. NOTIMP for an opcode other than QUERY
+*/
+static int reply_error(char* packet, const uint16_t rcode)
+{
+    dns_header_t* header = (dns_header_t*)packet;
+    header->flags = htons(QR_FLAG | (ntohs(header->flags) & (OPCODE_MASK | RD_FLAG)) | rcode);
+    header->qd_count = 0;
+    header->an_count = 0;
+    header->ns_count = 0;
+    header->ar_count = 0;
+    return sizeof(dns_header_t);
+}
+
+/*
+    Fast path for the "*" rule: answers a single question in place in the request buffer. The name is only walked
+    to find its end and the reply is truncated right after the question, dropping e.g. an EDNS OPT record. An A or
+    AAAA question gets the prebuilt answer, any other type (HTTPS, ...) a NODATA reply with the prebuilt SOA, so
+    clients get a definite answer for every query they send in parallel. Returns DNS_NOT_HANDLED for packets the
+    general path has to deal with.
+*/
+static int answer_wildcard(char* packet, const size_t len, const size_t max_len, const dns_server_handle_t h)
+{
+    if (len < sizeof(dns_header_t))
+    {
+        return -1;
+    }
+    dns_header_t* header = (dns_header_t*)packet;
+    if ((ntohs(header->flags) & OPCODE_MASK) != 0 || ntohs(header->qd_count) != 1)
+    {
+        return DNS_NOT_HANDLED;
+    }
+
+    size_t pos = skip_dns_name(packet, sizeof(dns_header_t), len);
+    if (pos == 0 || pos + sizeof(dns_question_t) > len)
+    {
+        return -1;
+    }
+    const dns_question_t* question = (const dns_question_t*)(packet + pos);
+    const uint16_t qd_type = ntohs(question->type);
+    const bool is_address = (qd_type == QD_TYPE_A || qd_type == QD_TYPE_AAAA) && ntohs(question->class) == QD_CLASS_IN;
+    pos += sizeof(dns_question_t);
+
+    if (is_address)
+    {
+        const int appended = append_answer(packet, &pos, max_len, h, 0, qd_type, sizeof(dns_header_t));
+        if (appended < 0)
+        {
+            return -1;
+        }
+        if (appended > 0)
+        {
+            set_reply_header(header, 1, 0);
+            return (int)pos;
+        }
+    }
+
+    if (pos + sizeof(dns_soa_t) > max_len)
+    {
+        return -1;
+    }
+    set_reply_header(header, 0, 1);
+    memcpy(packet + pos, &h->nodata_soa, sizeof(dns_soa_t));
+    return (int)(pos + sizeof(dns_soa_t));
+}
+
+/*
+    General path: answers every A and AAAA question a rule matches. If no question gets an answer, the reply is NODATA with
+    an SOA in the authority section, so the negative answer is cached for the negative TTL. Anything after the
+    questions is dropped.
+*/
 static int parse_dns_request(const char* req, const size_t req_len, char* dns_reply, size_t dns_reply_max_len,
                              dns_server_handle_t h)
 {
-    if (req_len > dns_reply_max_len)
+    if (req_len < sizeof(dns_header_t) || req_len > dns_reply_max_len)
     {
         return -1;
     }
-
-    // Prepare the reply
-    memset(dns_reply, 0, dns_reply_max_len);
     memcpy(dns_reply, req, req_len);
 
     // Endianess of NW packet different from chip
@@ -119,27 +560,28 @@ static int parse_dns_request(const char* req, const size_t req_len, char* dns_re
              ntohs(header->id), ntohs(header->flags), ntohs(header->qd_count));
 
     // Not a standard query
-    if ((header->flags & OPCODE_MASK) != 0)
+    if ((ntohs(header->flags) & OPCODE_MASK) != 0)
     {
-        return 0;
+        return reply_error(dns_reply, RCODE_NOTIMP);
     }
 
-    // Set question response flag
-    header->flags |= QR_FLAG;
-
-    uint16_t qd_count = ntohs(header->qd_count);
-    header->an_count = htons(qd_count);
-
-    const size_t reply_len = qd_count * sizeof(dns_answer_t) + req_len;
-    if (reply_len > dns_reply_max_len)
+    // Validate the question section and find its end, the answers go right after it
+    const uint16_t qd_count = ntohs(header->qd_count);
+    size_t reply_len = sizeof(dns_header_t);
+    for (int qd_i = 0; qd_i < qd_count; qd_i++)
     {
-        return -1;
+        reply_len = skip_dns_name(dns_reply, reply_len, req_len);
+        if (reply_len == 0 || reply_len + sizeof(dns_question_t) > req_len)
+        {
+            ESP_LOGD(TAG, "Malformed DNS question");
+            return -1;
+        }
+        reply_len += sizeof(dns_question_t);
     }
 
-    // Pointer to current answer and question
-    char* cur_ans_ptr = dns_reply + req_len;
     char* cur_qd_ptr = dns_reply + sizeof(dns_header_t);
     char name[128];
+    uint16_t an_count = 0;
 
     // Respond to all questions based on configured rules
     for (int qd_i = 0; qd_i < qd_count; qd_i++)
@@ -147,59 +589,158 @@ static int parse_dns_request(const char* req, const size_t req_len, char* dns_re
         char* name_end_ptr = parse_dns_name(cur_qd_ptr, name, sizeof(name));
         if (name_end_ptr == NULL)
         {
-            ESP_LOGE(TAG, "Failed to parse DNS question: %s", cur_qd_ptr);
+            ESP_LOGD(TAG, "Failed to parse DNS question");
             return -1;
         }
 
-        dns_question_t* question = (dns_question_t*)(name_end_ptr);
-        uint16_t qd_type = ntohs(question->type);
-        uint16_t qd_class = ntohs(question->class);
+        const dns_question_t* question = (const dns_question_t*)(name_end_ptr);
+        const uint16_t qd_type = ntohs(question->type);
+        const uint16_t qd_class = ntohs(question->class);
+        const uint16_t qd_offset = cur_qd_ptr - dns_reply;
+        cur_qd_ptr = name_end_ptr + sizeof(dns_question_t);
 
         ESP_LOGD(TAG, "Received type: %d | Class: %d | Question for: %s", qd_type, qd_class, name);
 
-        if (qd_type == QD_TYPE_A)
+        if ((qd_type != QD_TYPE_A && qd_type != QD_TYPE_AAAA) || qd_class != QD_CLASS_IN)
         {
-            esp_ip4_addr_t ip = {.addr = IPADDR_ANY};
-            // Check the configured rules to decide whether to answer this question or not
-            for (int i = 0; i < h->num_of_entries; ++i)
-            {
-                // check if the name either corresponds to the entry, or if we should answer to all queries ("*")
-                if (strcmp(h->entry[i].name, "*") == 0 || strcmp(h->entry[i].name, name) == 0)
-                {
-                    if (h->entry[i].if_key)
-                    {
-                        esp_netif_ip_info_t ip_info;
-                        esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey(h->entry[i].if_key), &ip_info);
-                        ip.addr = ip_info.ip.addr;
-                        break;
-                    }
-                    else if (h->entry->ip.addr != IPADDR_ANY)
-                    {
-                        ip.addr = h->entry[i].ip.addr;
-                        break;
-                    }
-                }
-            }
-            if (ip.addr == IPADDR_ANY)
-            {
-                // no rule applies, continue with another question
-                continue;
-            }
-            dns_answer_t* answer = (dns_answer_t*)cur_ans_ptr;
+            continue;
+        }
+        // Check the configured rules to decide whether to answer this question or not
+        const int rule = dns_rules_match(h->rules, name);
+        if (rule < 0)
+        {
+            // no rule applies, continue with another question
+            continue;
+        }
+        const int appended = append_answer(dns_reply, &reply_len, dns_reply_max_len, h, rule, qd_type, qd_offset);
+        if (appended < 0)
+        {
+            return -1;
+        }
+        an_count += appended;
+        ESP_LOGD(TAG, "Answer type %d for rule %d with PTR offset: 0x%" PRIX16, qd_type, rule, qd_offset);
+    }
 
-            answer->ptr_offset = htons(0xC000 | (cur_qd_ptr - dns_reply));
-            answer->type = htons(qd_type);
-            answer->class = htons(qd_class);
-            answer->ttl = htonl(ANS_TTL_SEC);
+    if (an_count == 0 && qd_count > 0)
+    {
+        if (reply_len + sizeof(dns_soa_t) > dns_reply_max_len)
+        {
+            return -1;
+        }
+        memcpy(dns_reply + reply_len, &h->nodata_soa, sizeof(dns_soa_t));
+        reply_len += sizeof(dns_soa_t);
+    }
+    set_reply_header(header, an_count, an_count == 0 && qd_count > 0 ? 1 : 0);
+    return (int)reply_len;
+}
 
-            ESP_LOGD(TAG, "Answer with PTR offset: 0x%" PRIX16 " and IP 0x%" PRIX32, ntohs(answer->ptr_offset),
-                     ip.addr);
+/*
+    Format the source of a datagram for logging
+*/
+static const char* source_str(const dns_slot_t* slot, char* buf, const size_t len)
+{
+    if (slot->addr.sin6_family == PF_INET)
+    {
+        inet_ntoa_r(((const struct sockaddr_in*)&slot->addr)->sin_addr.s_addr, buf, len - 1);
+    }
+    else if (slot->addr.sin6_family == PF_INET6)
+    {
+        inet6_ntoa_r(slot->addr.sin6_addr, buf, len - 1);
+    }
+    else
+    {
+        buf[0] = '\0';
+    }
+    return buf;
+}
 
-            answer->addr_len = htons(sizeof(ip.addr));
-            answer->ip_addr = ip.addr;
+/*
+    Take the datagrams already queued on the socket, up to DNS_BATCH.
+    Returns the number of datagrams received, -1 if the socket failed.
+*/
+static int receive_batch(const int sock, dns_slot_t* slots)
+{
+    int count = 0;
+    while (count < DNS_BATCH)
+    {
+        dns_slot_t* slot = &slots[count];
+        slot->addr_len = sizeof(slot->addr);
+        const int len = recvfrom(sock, slot->rx, DNS_MAX_LEN, MSG_DONTWAIT, (struct sockaddr*)&slot->addr,
+                                 &slot->addr_len);
+        if (len < 0)
+        {
+            // EWOULDBLOCK once the queue is drained, any other error shows up again on the next wait
+            return count > 0 || errno == EAGAIN || errno == EWOULDBLOCK ? count : -1;
         }
+        slot->len = len;
+        count++;
     }
-    return (int)reply_len;
+    return count;
+}
+
+/*
+    Send the replies of a batch back to back, slots without a reply are skipped.
+    Returns -1 if the socket failed.
+*/
+static int send_batch(const int sock, const dns_slot_t* slots, const int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const dns_slot_t* slot = &slots[i];
+        if (slot->len > 0 &&
+            sendto(sock, slot->reply, slot->len, 0, (const struct sockaddr*)&slot->addr, slot->addr_len) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Build the reply to the datagram in `slot`, leaves the length of the reply in `slot->len`
+*/
+static void answer_query(const dns_server_handle_t handle, dns_slot_t* slot)
+{
+    char addr_str[128];
+    const int len = slot->len;
+    handle->stats.queries++;
+    slot->reply = slot->rx;
+
+    if (!take_token(handle, &slot->addr))
+    {
+        if (!handle->refuse_over_limit || len < (int)sizeof(dns_header_t))
+        {
+            handle->stats.dropped++;
+            slot->len = 0;
+            ESP_LOGD(TAG, "Dropped query from %s over the rate limit", source_str(slot, addr_str, sizeof(addr_str)));
+            return;
+        }
+        handle->stats.refused++;
+        slot->len = reply_error(slot->rx, RCODE_REFUSED);
+        return;
+    }
+
+    // Null-terminate whatever we received and treat like a string...
+    slot->rx[len] = 0;
+
+    int reply_len = handle->wildcard_only ? answer_wildcard(slot->rx, len, DNS_MAX_LEN, handle) : DNS_NOT_HANDLED;
+    if (reply_len == DNS_NOT_HANDLED)
+    {
+        slot->reply = slot->tx;
+        reply_len = parse_dns_request(slot->rx, len, slot->tx, sizeof(slot->tx), handle);
+    }
+
+    ESP_LOGD(TAG, "Received %d bytes from %s | DNS reply with len: %d", len,
+             source_str(slot, addr_str, sizeof(addr_str)), reply_len);
+    if (reply_len > 0)
+    {
+        handle->stats.answered++;
+    }
+    else
+    {
+        handle->stats.malformed++;
+    }
+    slot->len = reply_len;
 }
 
 /*
@@ -208,19 +749,25 @@ static int parse_dns_request(const char* req, const size_t req_len, char* dns_re
 */
 void dns_server_task(void* pvParameters)
 {
-    char rx_buffer[128];
-    char addr_str[128];
     dns_server_handle_t handle = pvParameters;
 
     while (handle->started)
     {
+#if CONFIG_LWIP_IPV6
+        // Dual-stack: an IPv6 socket bound to :: receives IPv4 queries too, as IPv4-mapped addresses
+        struct sockaddr_in6 dest_addr = {0};
+        dest_addr.sin6_family = AF_INET6;
+        dest_addr.sin6_port = htons(DNS_PORT);
+        int addr_family = AF_INET6;
+        int ip_protocol = IPPROTO_IPV6;
+#else
         struct sockaddr_in dest_addr;
         dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
         dest_addr.sin_family = AF_INET;
         dest_addr.sin_port = htons(DNS_PORT);
         int addr_family = AF_INET;
         int ip_protocol = IPPROTO_IP;
-        inet_ntoa_r(dest_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
+#endif
 
         const int sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
         if (sock < 0)
@@ -229,74 +776,196 @@ void dns_server_task(void* pvParameters)
             break;
         }
         ESP_LOGI(TAG, "Socket created");
+#if CONFIG_LWIP_IPV6
+        const int v6only = 0;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+#endif
 
         int err = bind(sock, (struct sockaddr*)&dest_addr, sizeof(dest_addr));
         if (err < 0)
         {
             ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+            close(sock);
+            // Retry later, e.g. while the previous socket on the port is still going away
+            vTaskDelay(pdMS_TO_TICKS(DNS_POLL_MS));
+            continue;
         }
         ESP_LOGI(TAG, "Socket bound, port %d", DNS_PORT);
 
         while (handle->started)
         {
-            ESP_LOGI(TAG, "Waiting for data");
-            struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
-            socklen_t socklen = sizeof(source_addr);
-            int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr*)&source_addr, &socklen);
+            ESP_LOGD(TAG, "Waiting for data");
+            fd_set read_set;
+            FD_ZERO(&read_set);
+            FD_SET(sock, &read_set);
+            FD_SET(handle->ctrl_sock, &read_set);
+            struct timeval timeout = {.tv_sec = DNS_POLL_MS / 1000, .tv_usec = (DNS_POLL_MS % 1000) * 1000};
+            const int ready = select(MAX(sock, handle->ctrl_sock) + 1, &read_set, NULL, NULL, &timeout);
+            if (ready < 0)
+            {
+                ESP_LOGE(TAG, "select failed: errno %d", errno);
+                break;
+            }
+            if (!FD_ISSET(sock, &read_set))
+            {
+                // Timeout or wake-up, look at the stop flag again
+                continue;
+            }
 
-            // Error occurred during receiving
-            if (len < 0)
+            const int count = receive_batch(sock, handle->slots);
+            if (count < 0)
             {
                 ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
-                close(sock);
                 break;
             }
-            // Data received
-            else
+            if (count > 0)
             {
-                // Get the sender's ip address as string
-                if (source_addr.sin6_family == PF_INET)
-                {
-                    inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-                }
-                else if (source_addr.sin6_family == PF_INET6)
-                {
-                    inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
-                }
-
-                // Null-terminate whatever we received and treat like a string...
-                rx_buffer[len] = 0;
-
-                char reply[DNS_MAX_LEN];
-                int reply_len = parse_dns_request(rx_buffer, len, reply, DNS_MAX_LEN, handle);
-
-                ESP_LOGI(TAG, "Received %d bytes from %s | DNS reply with len: %d", len, addr_str, reply_len);
-                if (reply_len <= 0)
-                {
-                    ESP_LOGE(TAG, "Failed to prepare a DNS reply");
-                }
-                else
-                {
-                    err = sendto(sock, reply, reply_len, 0, (struct sockaddr*)&source_addr, sizeof(source_addr));
-                    if (err < 0)
-                    {
-                        ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-                        break;
-                    }
-                }
+                handle->stats.batches++;
             }
-        }
 
-        if (sock != -1)
-        {
-            ESP_LOGE(TAG, "Shutting down socket");
-            shutdown(sock, 0);
-            close(sock);
+            for (int i = 0; i < count; i++)
+            {
+                answer_query(handle, &handle->slots[i]);
+            }
+            if (send_batch(sock, handle->slots, count) < 0)
+            {
+                ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+                break;
+            }
         }
+
+        ESP_LOGI(TAG, "Shutting down socket");
+        close(sock);
     }
+    // stop_dns_server() frees the handle once this is given, nothing may touch it afterwards
+    xSemaphoreGive(handle->stopped);
     vTaskDelete(NULL);
 }
 
+/*
+    Receive callback of the raw PCB, runs in the tcpip thread. Callbacks never overlap, so one slot is enough.
+*/
+static void dns_udp_recv(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, const u16_t port)
+{
+    dns_server_handle_t handle = arg;
+    dns_slot_t* slot = &handle->slots[0];
+    slot->len = pbuf_copy_partial(p, slot->rx, DNS_MAX_LEN, 0);
+    pbuf_free(p);
+    handle->stats.batches++;
+
+    // Rate limiting and logging key on a socket address, like in the task
+    memset(&slot->addr, 0, sizeof(slot->addr));
+#if LWIP_IPV6
+    if (IP_IS_V6(addr))
+    {
+        slot->addr.sin6_family = AF_INET6;
+        memcpy(&slot->addr.sin6_addr, ip_2_ip6(addr)->addr, sizeof(slot->addr.sin6_addr));
+    }
+    else
+#endif
+    {
+        struct sockaddr_in* source4 = (struct sockaddr_in*)&slot->addr;
+        source4->sin_family = AF_INET;
+        source4->sin_addr.s_addr = ip_2_ip4(addr)->addr;
+    }
+
+    answer_query(handle, slot);
+    if (slot->len <= 0)
+    {
+        return;
+    }
+    struct pbuf* reply = pbuf_alloc(PBUF_TRANSPORT, slot->len, PBUF_RAM);
+    if (reply == NULL)
+    {
+        ESP_LOGD(TAG, "No memory for a DNS reply");
+        return;
+    }
+    pbuf_take(reply, slot->reply, slot->len);
+    udp_sendto(pcb, reply, addr, port);
+    pbuf_free(reply);
+}
+
+typedef struct
+{
+    struct tcpip_api_call_data call;
+    dns_server_handle_t handle;
+} dns_pcb_call_t;
+
+static err_t dns_pcb_start(struct tcpip_api_call_data* call)
+{
+    dns_server_handle_t handle = ((dns_pcb_call_t*)call)->handle;
+    // IPADDR_TYPE_ANY takes queries over both IPv4 and IPv6
+    handle->pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (handle->pcb == NULL)
+    {
+        return ERR_MEM;
+    }
+    const err_t err = udp_bind(handle->pcb, IP_ANY_TYPE, DNS_PORT);
+    if (err != ERR_OK)
+    {
+        udp_remove(handle->pcb);
+        handle->pcb = NULL;
+        return err;
+    }
+    udp_recv(handle->pcb, dns_udp_recv, handle);
+    return ERR_OK;
+}
+
+static err_t dns_pcb_stop(struct tcpip_api_call_data* call)
+{
+    dns_server_handle_t handle = ((dns_pcb_call_t*)call)->handle;
+    // No callback can be running, this runs in the tcpip thread too
+    udp_remove(handle->pcb);
+    handle->pcb = NULL;
+    return ERR_OK;
+}
+
+/*
+    Create the loopback socket stop_dns_server() wakes the task up with
+*/
+static int create_ctrl_sock(struct sockaddr_in* addr)
+{
+    const int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = 0;
+    socklen_t addr_len = sizeof(*addr);
+    // Let the stack pick a free port and read it back
+    if (bind(sock, (struct sockaddr*)addr, sizeof(*addr)) < 0 ||
+        getsockname(sock, (struct sockaddr*)addr, &addr_len) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+    Free everything start_dns_server() allocated, the task must not be running
+*/
+static void free_handle(dns_server_handle_t handle)
+{
+    if (handle->ctrl_sock >= 0)
+    {
+        close(handle->ctrl_sock);
+    }
+    if (handle->stopped)
+    {
+        vSemaphoreDelete(handle->stopped);
+    }
+    dns_rules_free(handle->rules);
+    free(handle->entry_addr);
+    free(handle->entry_addr6);
+    free(handle->clients);
+    free(handle->slots);
+    free(handle);
+}
+
 /**
  * @brief start a dns server
  *
@@ -310,11 +979,102 @@ dns_server_handle_t start_dns_server(dns_server_config_t* config)
     ESP_RETURN_ON_FALSE(handle, NULL, TAG, "Failed to allocate dns server handle");
 
     handle->started = true;
+    handle->ctrl_sock = -1;
     handle->num_of_entries = config->num_of_entries;
     memcpy(handle->entry, config->item, config->num_of_entries * sizeof(dns_entry_pair_t));
 
-    xTaskCreate(dns_server_task, "dns_server", 4096, handle, 5, &handle->task);
-    return handle;
+    handle->rules = dns_rules_build(handle->entry, handle->num_of_entries);
+    handle->entry_addr = calloc(config->num_of_entries, sizeof(uint32_t));
+    handle->entry_addr6 = calloc(config->num_of_entries, sizeof(esp_ip6_addr_t));
+    handle->slots = calloc(config->in_tcpip_task ? 1 : DNS_BATCH, sizeof(dns_slot_t));
+    if (handle->rules == NULL || handle->entry_addr == NULL || handle->entry_addr6 == NULL || handle->slots == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to build the DNS rule index");
+        free_handle(handle);
+        return NULL;
+    }
+    handle->rate_limit = config->rate_limit;
+    handle->rate_burst = MAX(config->rate_burst, 1) * 1000;
+    handle->refuse_over_limit = config->refuse_over_limit;
+    if (config->rate_limit)
+    {
+        handle->num_of_clients = config->rate_clients ? config->rate_clients : DNS_RATE_CLIENTS;
+        handle->clients = calloc(handle->num_of_clients, sizeof(dns_client_bucket_t));
+        if (handle->clients == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to allocate the DNS rate limit table");
+            free_handle(handle);
+            return NULL;
+        }
+    }
+    if (!config->in_tcpip_task)
+    {
+        handle->stopped = xSemaphoreCreateBinary();
+        handle->ctrl_sock = create_ctrl_sock(&handle->ctrl_addr);
+        if (handle->stopped == NULL || handle->ctrl_sock < 0)
+        {
+            ESP_LOGE(TAG, "Failed to create the DNS server's stop signal");
+            free_handle(handle);
+            return NULL;
+        }
+    }
+    portMUX_INITIALIZE(&handle->addr6_lock);
+    refresh_entry_addrs(handle);
+    taskENTER_CRITICAL(&servers_lock);
+    handle->next = servers;
+    servers = handle;
+    taskEXIT_CRITICAL(&servers_lock);
+    if (esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID, dns_ip_event_handler, handle,
+                                            &handle->ip_event_instance) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to register DNS IP event handler, netif addresses will not be refreshed");
+    }
+
+    const uint32_t ttl = config->ttl ? config->ttl : ANS_TTL_SEC;
+    const uint32_t negative_ttl = config->negative_ttl ? config->negative_ttl : NEGATIVE_TTL_SEC;
+    handle->wildcard_only = config->num_of_entries == 1 && strcmp(config->item[0].name, "*") == 0;
+    handle->wildcard_answer.ptr_offset = htons(FIRST_NAME_PTR);
+    handle->wildcard_answer.type = htons(QD_TYPE_A);
+    handle->wildcard_answer.class = htons(QD_CLASS_IN);
+    handle->wildcard_answer.ttl = htonl(ttl);
+    handle->wildcard_answer.addr_len = htons(sizeof(uint32_t));
+
+    // Resolvers cache a NODATA reply for min(SOA TTL, SOA minimum), RFC 2308
+    handle->nodata_soa.ptr_offset = htons(FIRST_NAME_PTR);
+    handle->nodata_soa.type = htons(QD_TYPE_SOA);
+    handle->nodata_soa.class = htons(QD_CLASS_IN);
+    handle->nodata_soa.ttl = htonl(negative_ttl);
+    handle->nodata_soa.data_len = htons(sizeof(dns_soa_t) - offsetof(dns_soa_t, mname_ptr));
+    handle->nodata_soa.mname_ptr = htons(FIRST_NAME_PTR);
+    handle->nodata_soa.rname_ptr = htons(FIRST_NAME_PTR);
+    handle->nodata_soa.serial = htonl(1);
+    handle->nodata_soa.refresh = htonl(negative_ttl);
+    handle->nodata_soa.retry = htonl(negative_ttl);
+    handle->nodata_soa.expire = htonl(negative_ttl);
+    handle->nodata_soa.minimum = htonl(negative_ttl);
+
+    if (config->in_tcpip_task)
+    {
+        dns_pcb_call_t call = {.handle = handle};
+        const err_t err = tcpip_api_call(dns_pcb_start, &call.call);
+        if (err == ERR_OK)
+        {
+            ESP_LOGI(TAG, "DNS server bound, port %d", DNS_PORT);
+            return handle;
+        }
+        ESP_LOGE(TAG, "Failed to bind the DNS server: %d", err);
+    }
+    else if (xTaskCreate(dns_server_task, "dns_server", 4096, handle, 5, &handle->task) == pdPASS)
+    {
+        return handle;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to create the DNS server task");
+    }
+    unlink_server(handle);
+    free_handle(handle);
+    return NULL;
 }
 
 /**
@@ -327,7 +1087,33 @@ void stop_dns_server(dns_server_handle_t handle)
     if (handle)
     {
         handle->started = false;
-        vTaskDelete(handle->task);
-        free(handle);
+        unlink_server(handle);
+        if (handle->pcb)
+        {
+            dns_pcb_call_t call = {.handle = handle};
+            tcpip_api_call(dns_pcb_stop, &call.call);
+        }
+        else
+        {
+            // Wake the task up, if the datagram gets lost it still sees the flag within DNS_POLL_MS
+            const char wake = 0;
+            sendto(handle->ctrl_sock, &wake, sizeof(wake), 0, (struct sockaddr*)&handle->ctrl_addr,
+                   sizeof(handle->ctrl_addr));
+            if (xSemaphoreTake(handle->stopped, pdMS_TO_TICKS(2 * DNS_POLL_MS)) != pdTRUE)
+            {
+                // Freeing the handle under a running task is worse than leaking it
+                ESP_LOGE(TAG, "DNS server task did not stop, leaking its handle");
+                return;
+            }
+        }
+        ESP_LOGI(TAG, "DNS server stopped: %" PRIu32 " queries, %" PRIu32 " answered, %" PRIu32 " refused, %" PRIu32
+                      " dropped, %" PRIu32 " malformed", handle->stats.queries, handle->stats.answered,
+                 handle->stats.refused, handle->stats.dropped, handle->stats.malformed);
+        free_handle(handle);
     }
 }
+
+void dns_server_get_stats(dns_server_handle_t handle, dns_server_stats_t* stats)
+{
+    *stats = handle->stats;
+}
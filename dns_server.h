@@ -22,19 +22,25 @@ extern "C" {
 /**
  * @brief Definition of one DNS entry: NAME - IP (or the netif whose IP to answer)
  *
+ * With `if_key`, A queries are answered with the netif's IPv4 address and AAAA queries with its unique local or
+ * global IPv6 address. With only a link-local address, which clients cannot use without a zone, AAAA gets NODATA.
+ *
  * @note Please use string literals (or ensure they are valid during dns_server lifetime) as names, since
  * we don't take copies of the config values `name` and `if_key`
  */
 typedef struct dns_entry_pair {
-    const char* name;       /**<! Exact match of the name field of the DNS query to answer */
+    const char* name;       /**<! Name to answer: an exact name, `*.suffix` for any name below suffix, or `*` */
     const char* if_key;     /**<! Use this network interface IP to answer, only if NULL, use the static IP below */
     esp_ip4_addr_t ip;      /**<! Constant IP address to answer this query, if "if_key==NULL" */
+    esp_ip6_addr_t ip6;     /**<! Constant IPv6 address to answer AAAA queries, if "if_key==NULL", all zero for none */
 } dns_entry_pair_t;
 
 /**
- * @brief DNS server config struct defining the rules for answering DNS (A type) queries
+ * @brief DNS server config struct defining the rules for answering DNS (A and AAAA type) queries
  *
- * @note If you want to define more rules, you can set `DNS_SERVER_MAX_ITEMS` before including this header
+ * @note If you want to define more rules, you can set `DNS_SERVER_MAX_ITEMS` before including this header.
+ * The rules are compiled into an index when the server starts, so hundreds of rules cost no more per query than one.
+ * Names are matched case-insensitively; an exact name wins over the longest `*.suffix`, which wins over `*`.
  * Example of using 2 entries with constant IP addresses
  * \code{.c}
  * #define DNS_SERVER_MAX_ITEMS 2
@@ -50,24 +56,64 @@ typedef struct dns_entry_pair {
 typedef struct dns_server_config {
     int num_of_entries;                             /**<! Number of rules specified in the config struct */
     dns_entry_pair_t item[DNS_SERVER_MAX_ITEMS];    /**<! Array of pairs */
+    uint32_t ttl;                                   /**<! TTL of answers in seconds, 0 for the default (300) */
+    uint32_t negative_ttl;                          /**<! TTL of NODATA replies in seconds, 0 for the default (60) */
+    uint16_t rate_limit;                            /**<! Queries per second per source address, 0 for no limit */
+    uint16_t rate_burst;                            /**<! Queries a source may send at once before the limit applies */
+    uint16_t rate_clients;                          /**<! Source addresses tracked for the limit, 0 for the default (8) */
+    bool refuse_over_limit;                         /**<! Answer queries over the limit with REFUSED, else drop them */
+    bool in_tcpip_task;                             /**<! Serve a raw lwIP PCB from the tcpip thread, no own task */
 } dns_server_config_t;
 
+/**
+ * @brief DNS server counters since start
+ */
+typedef struct dns_server_stats {
+    uint32_t queries;       /**<! Packets received */
+    uint32_t answered;      /**<! Queries replied to (answers, NODATA and NOTIMP) */
+    uint32_t refused;       /**<! Queries over the rate limit answered with REFUSED */
+    uint32_t dropped;       /**<! Queries over the rate limit dropped */
+    uint32_t malformed;     /**<! Packets no reply could be built for */
+    uint32_t batches;       /**<! Receive wake-ups, each takes up to 4 packets in the own task and 1 in the tcpip task */
+} dns_server_stats_t;
+
 /**
  * @brief DNS server handle
  */
 typedef struct dns_server_handle *dns_server_handle_t;
 
 /**
- * @brief Set ups and starts a simple DNS server that will respond to all A queries (IPv4)
- * based on configured rules, pairs of name and either IPv4 address or a netif ID (to respond by it's IPv4 add)
+ * @brief Set ups and starts a simple DNS server that will respond to A (IPv4) and AAAA (IPv6) queries
+ * based on configured rules, pairs of name and either IP addresses or a netif ID (to respond by it's addresses).
+ * With IPv6 enabled in lwIP, the server listens on a dual-stack socket for queries over both IPv4 and IPv6.
+ *
+ * Queries of other types, and A queries no rule answers, get a NODATA reply with an SOA record, so clients cache
+ * the negative answer instead of waiting for a timeout.
+ *
+ * With `in_tcpip_task`, queries are answered in lwIP's tcpip thread from a raw UDP PCB instead of a socket served by
+ * a task of the DNS server's own, saving the task's 4 kB stack and most of its buffers.
+ *
+ * With `rate_limit` set, every source address gets a token bucket of `rate_burst` queries refilled at `rate_limit`
+ * per second. The table of buckets is fixed in size; when it is full, the least recently seen source is replaced.
  *
  * @param config Configuration structure listing the pairs of (name, IP/netif-id)
  * @return dns_server's handle on success, NULL on failure
  */
 dns_server_handle_t start_dns_server(dns_server_config_t *config);
 
+/**
+ * @brief Read the DNS server's counters
+ * @param handle DNS server's handle
+ * @param stats Filled with the counters
+ */
+void dns_server_get_stats(dns_server_handle_t handle, dns_server_stats_t* stats);
+
 /**
  * @brief Stops and destroys DNS server's task and structs
+ *
+ * The task is woken up and closes its socket before the handle is freed, so port 53 is free again when this returns.
+ * Returns within two seconds even if the wake-up gets lost. May be called from any task: an IP event handler still
+ * refreshing the rule addresses is waited for.
  * @param handle DNS server's handle to destroy
  */
 void stop_dns_server(dns_server_handle_t handle);
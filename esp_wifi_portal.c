@@ -4,11 +4,16 @@
 #include <esp_http_server.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
 #include <lwip/inet.h>
 
 #include "dns_server.h"
 #include "http_server.h"
+#include "portal_connect.h"
+#include "portal_creds.h"
+#include "portal_join.h"
+#include "scan_cache.h"
 
 static const char* TAG = "esp_wifi_portal";
 
@@ -20,7 +25,16 @@ static bool is_auto_start = true;
 
 static bool is_portal_running = false;
 
-EventGroupHandle_t wifi_event_group = NULL;
+static esp_timer_handle_t portal_stop_timer = NULL;
+
+// Private events of the portal, handled on the default event loop
+static ESP_EVENT_DEFINE_BASE(PORTAL_EVENT);
+enum
+{
+    PORTAL_EVENT_STOP,
+};
+
+static esp_event_handler_instance_t portal_event_handler_instance = NULL;
 
 static dns_server_handle_t dns_server = NULL;
 
@@ -43,21 +57,50 @@ static void sta_event_handler(void* arg, const esp_event_base_t event_base,
         if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
         {
             ESP_LOGI(TAG, "Wifi STA Started");
-            esp_wifi_connect();
         }
         else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
         {
-            ESP_LOGI(TAG, "Wifi STA Disconnected");
-            if (is_auto_start)
-            {
-                esp_wifi_portal_start();
-            }
+            const wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*)event_data;
+            ESP_LOGI(TAG, "Wifi STA Disconnected, reason: %d", event->reason);
         }
         else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
         {
             const ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
             ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
         }
+
+        // The reconnect policy gave up, recovery needs a human
+        if (portal_join_on_event(event_base, event_id, event_data) && is_auto_start)
+        {
+            esp_wifi_portal_start();
+        }
+    }
+}
+
+/*
+    Nobody may come to provision the device, e.g. after a long router outage. The stored networks are retried from
+    the portal's background scans now and then, unless a client is on the softAP and might be using the portal.
+*/
+static void retry_stored_network(void)
+{
+    wifi_sta_list_t clients;
+    if (esp_wifi_ap_get_sta_list(&clients) != ESP_OK || clients.num > 0)
+    {
+        return;
+    }
+    portal_connect_status_t status;
+    portal_connect_get_status(&status);
+    if (status.stage != PORTAL_CONNECT_IDLE && status.stage != PORTAL_CONNECT_FAILED)
+    {
+        return;
+    }
+    wifi_config_t sta_cfg;
+    uint8_t channel = 0;
+    uint32_t attempt = 0;
+    if (portal_join_portal_retry(&sta_cfg, &channel))
+    {
+        // Getting an IP stops the portal like a connect from the page does
+        portal_connect_start(&sta_cfg, channel, &attempt);
     }
 }
 
@@ -75,23 +118,70 @@ static esp_event_handler_instance_t ap_event_handler_ip_instance;
 static void ap_event_handler(void* arg, const esp_event_base_t event_base,
                              const int32_t event_id, void* event_data)
 {
-    if (is_portal_running == true)
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_START)
     {
-        if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_START)
+        // May arrive before the portal is flagged running, the address has to be there for DNS either way
+        ESP_LOGI(TAG, "Wifi AP Started");
+#if CONFIG_LWIP_IPV6
+        // Give the softAP a link-local address so the dual-stack DNS socket can answer queries sent over IPv6. AAAA
+        // is only answered once the softAP also has a unique local or global address.
+        esp_netif_t* netif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
+        if (netif != NULL && esp_netif_create_ip6_linklocal(netif) != ESP_OK)
         {
-            ESP_LOGI(TAG, "Wifi AP Started");
+            ESP_LOGW(TAG, "Failed to create a link-local IPv6 address on the softAP");
+        }
+#endif
+    }
+    else if (is_portal_running == true)
+    {
+        if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE)
+        {
+            scan_cache_on_scan_done((const wifi_event_sta_scan_done_t*)event_data);
+            http_server_notify_scan_done();
+            retry_stored_network();
+        }
+        else if (event_base == WIFI_EVENT &&
+                 (event_id == WIFI_EVENT_STA_CONNECTED || event_id == WIFI_EVENT_STA_DISCONNECTED ||
+                  event_id == WIFI_EVENT_AP_STADISCONNECTED))
+        {
+            portal_connect_on_event(event_base, event_id, event_data);
         }
         else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
         {
             const ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
             ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-            if (wifi_event_group != NULL) { xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT); }
-            vTaskDelay(pdMS_TO_TICKS(100));
-            esp_wifi_portal_stop();
+            portal_join_remember();
+            portal_connect_on_event(event_base, event_id, event_data);
+            // Leave the portal up for a moment so the client can pick up the result from /status
+            esp_timer_stop(portal_stop_timer);
+            esp_timer_start_once(portal_stop_timer, CONFIG_ESP_WIFI_PORTAL_STOP_DELAY_MS * 1000ULL);
         }
     }
 }
 
+/*
+    Stopping the portal can block for a while (the DNS server waits for its task), so it does not run in the
+    esp_timer task. It is posted to the default event loop, which also delivers the scan and connect events the
+    portal's modules handle.
+*/
+static void portal_stop_timer_callback(void* arg)
+{
+    if (esp_event_post(PORTAL_EVENT, PORTAL_EVENT_STOP, NULL, 0, 0) != ESP_OK)
+    {
+        // Event queue full, try again shortly
+        esp_timer_start_once(portal_stop_timer, 100 * 1000ULL);
+    }
+}
+
+static void portal_event_handler(void* arg, const esp_event_base_t event_base,
+                                 const int32_t event_id, void* event_data)
+{
+    if (event_id == PORTAL_EVENT_STOP && is_portal_running == true)
+    {
+        esp_wifi_portal_stop();
+    }
+}
+
 /**
  * @brief Register event handlers for station mode WiFi events
  *
@@ -152,6 +242,24 @@ static esp_err_t unregisterStaEventHandlers(void)
     return ESP_OK;
 }
 
+/*
+    Carry a network provisioned before the credential store existed over into the store
+*/
+static void import_sta_config(const wifi_config_t* sta_cfg)
+{
+    esp_wifi_portal_cred_t cred;
+    size_t count = 0;
+    if (esp_wifi_portal_cred_list(&cred, 1, &count) != ESP_OK || count > 0)
+    {
+        return;
+    }
+    char ssid[sizeof(sta_cfg->sta.ssid) + 1] = {0};
+    char password[sizeof(sta_cfg->sta.password) + 1] = {0};
+    memcpy(ssid, sta_cfg->sta.ssid, sizeof(sta_cfg->sta.ssid));
+    memcpy(password, sta_cfg->sta.password, sizeof(sta_cfg->sta.password));
+    esp_wifi_portal_cred_add(ssid, password, 0);
+}
+
 /**
  * @brief Create the station network interface
  *
@@ -173,6 +281,10 @@ static void create_sta_netif(void)
             ESP_LOGW(TAG, "sta ssid is empty, use default ssid: %s", "ap");
             strcpy((char*)sta_cfg.sta.ssid, "ap");
         }
+        else
+        {
+            import_sta_config(&sta_cfg);
+        }
         ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_cfg)); // 写回配置
     }
 }
@@ -196,7 +308,7 @@ static esp_err_t registerApEventHandlers(void)
     }
 
     err = esp_event_handler_instance_register(WIFI_EVENT,
-                                              WIFI_EVENT_AP_START,
+                                              ESP_EVENT_ANY_ID,
                                               &ap_event_handler,
                                               NULL,
                                               &ap_event_handler_wifi_instance);
@@ -227,7 +339,7 @@ static esp_err_t unregisterApEventHandlers(void)
 
 
     err = esp_event_handler_instance_unregister(WIFI_EVENT,
-                                                WIFI_EVENT_AP_START,
+                                                ESP_EVENT_ANY_ID,
                                                 ap_event_handler_wifi_instance);
     if (err != ESP_OK)
     {
@@ -298,6 +410,15 @@ esp_err_t esp_wifi_portal_init(void)
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(registerStaEventHandlers());
     ESP_ERROR_CHECK(registerApEventHandlers());
+    const esp_timer_create_args_t timer_args = {
+        .callback = portal_stop_timer_callback,
+        .name = "portal_stop"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &portal_stop_timer));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(PORTAL_EVENT, ESP_EVENT_ANY_ID, &portal_event_handler, NULL,
+                                                        &portal_event_handler_instance));
+    ESP_ERROR_CHECK(portal_creds_init());
+    ESP_ERROR_CHECK(portal_join_init());
     create_sta_netif();
     ESP_ERROR_CHECK(esp_wifi_start());
     return ESP_OK;
@@ -340,6 +461,9 @@ esp_err_t esp_wifi_portal_start(void)
         return ESP_FAIL;
     }
 
+    // The portal drives the station from now on
+    portal_join_cancel();
+
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
 
     create_ap_netif();
@@ -348,12 +472,9 @@ esp_err_t esp_wifi_portal_start(void)
     dhcp_set_captive_portal_url();
 #endif
 
-    if (wifi_event_group == NULL)
-    {
-        wifi_event_group = xEventGroupCreate();
-    }
+    ESP_ERROR_CHECK(portal_connect_init(http_server_notify_status));
 
-    const esp_err_t ret = start_webserver(wifi_event_group);
+    const esp_err_t ret = start_webserver();
     if (ret != ESP_OK)
     {
         ESP_LOGE(TAG, "Failed to start web server");
@@ -361,13 +482,31 @@ esp_err_t esp_wifi_portal_start(void)
     }
 
     // Start the DNS server that will redirect all queries to the softAP IP
-    dns_server_config_t config = DNS_SERVER_CONFIG_SINGLE("*" /* all A queries */, "WIFI_AP_DEF" /* softAP netif ID */);
+    dns_server_config_t config = DNS_SERVER_CONFIG_SINGLE("*" /* all A and AAAA queries */, "WIFI_AP_DEF" /* softAP netif ID */);
+    config.ttl = CONFIG_ESP_WIFI_PORTAL_DNS_TTL_SEC;
+    config.negative_ttl = CONFIG_ESP_WIFI_PORTAL_DNS_NEGATIVE_TTL_SEC;
+#ifdef CONFIG_ESP_WIFI_PORTAL_DNS_IN_TCPIP_TASK
+    config.in_tcpip_task = true;
+#endif
+#if CONFIG_ESP_WIFI_PORTAL_DNS_RATE_LIMIT > 0
+    config.rate_limit = CONFIG_ESP_WIFI_PORTAL_DNS_RATE_LIMIT;
+    config.rate_burst = CONFIG_ESP_WIFI_PORTAL_DNS_RATE_BURST;
+    config.rate_clients = CONFIG_ESP_WIFI_PORTAL_DNS_RATE_CLIENTS;
+#ifdef CONFIG_ESP_WIFI_PORTAL_DNS_REFUSE_OVER_LIMIT
+    config.refuse_over_limit = true;
+#endif
+#endif
     dns_server = start_dns_server(&config);
     if (dns_server == NULL)
     {
         ESP_LOGE(TAG, "Failed to start DNS server");
         return ESP_FAIL;
     }
+
+    if (scan_cache_start() != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to start scan cache, network list will be empty");
+    }
     is_portal_running = true;
     return ESP_OK;
 }
@@ -381,11 +520,12 @@ esp_err_t esp_wifi_portal_stop(void)
     }
     is_portal_running = false;
 
+    esp_timer_stop(portal_stop_timer);
+    scan_cache_stop();
     stop_dns_server(dns_server);
     dns_server = NULL;
     ESP_ERROR_CHECK(stop_webserver());
-    vEventGroupDelete(wifi_event_group);
-    wifi_event_group = NULL;
+    portal_connect_deinit();
     // 如果 Log level 是 info 打印 wifi config
 #if CONFIG_LOG_DEFAULT_LEVEL >= ESP_LOG_INFO
     wifi_config_t wifi_sta_cfg;
@@ -408,11 +548,17 @@ esp_err_t esp_wifi_portal_deinit(void)
     }
     ESP_ERROR_CHECK(unregisterStaEventHandlers());
     ESP_ERROR_CHECK(unregisterApEventHandlers());
+    if (portal_event_handler_instance != NULL)
+    {
+        esp_event_handler_instance_unregister(PORTAL_EVENT, ESP_EVENT_ANY_ID, portal_event_handler_instance);
+        portal_event_handler_instance = NULL;
+    }
     ESP_ERROR_CHECK(esp_wifi_stop());
-    if (wifi_event_group != NULL)
+    if (portal_stop_timer != NULL)
     {
-        vEventGroupDelete(wifi_event_group);
-        wifi_event_group = NULL;
+        esp_timer_stop(portal_stop_timer);
+        esp_timer_delete(portal_stop_timer);
+        portal_stop_timer = NULL;
     }
     if (ap_netif != NULL)
     {
@@ -426,6 +572,8 @@ esp_err_t esp_wifi_portal_deinit(void)
     }
 
     ESP_ERROR_CHECK(esp_wifi_deinit());
+    portal_join_deinit();
+    portal_creds_deinit();
 
     return ESP_OK;
 }
@@ -1,179 +1,827 @@
 #include "http_server.h"
 
-#include <cJSON.h>
 #include <esp_http_server.h>
+#include <esp_idf_version.h>
 #include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "asset_bundle.h"
+#include "captive_probe.h"
+#include "connect_parser.h"
+#include "json_stream.h"
+#include "portal_connect.h"
+#include "scan_cache.h"
 
 extern const char root_start[] asm("_binary_root_html_start");
 extern const char root_end[] asm("_binary_root_html_end");
+// The same page gzip-compressed at build time in two halves around ROOT_SCAN_MARKER, see tools/gzip_file.py
+extern const char root_gz_start[] asm("_binary_root_html_gz_start");
+extern const char root_gz_end[] asm("_binary_root_html_gz_end");
+
+// Replaced by the cached scan results when the page is served
+#define ROOT_SCAN_MARKER "<!--SCAN-->"
+
+#define ASYNC_REQ_SUPPORTED (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0))
+#define PARKED_REQ_MAX 4
+#define STATUS_LONG_POLL_MS 10000
+#define WS_CLIENTS_MAX 4
+#define CONNECT_BODY_MAX 1024
+#define CONNECT_RECV_TIMEOUTS 3
+
+// The DNS server runs alongside with a socket and a wake-up socket, none in the tcpip task
+#ifdef CONFIG_ESP_WIFI_PORTAL_DNS_IN_TCPIP_TASK
+#define DNS_SOCKETS 0
+#else
+#define DNS_SOCKETS 2
+#endif
+// httpd_start() takes 3 sockets of its own besides the connections
+#define HTTPD_CONNECTIONS_MAX (CONFIG_LWIP_MAX_SOCKETS - 3 - DNS_SOCKETS)
+#if HTTPD_CONNECTIONS_MAX < 1
+#error "LWIP_MAX_SOCKETS leaves no socket for web server connections next to the DNS server"
+#endif
 
 static const char* TAG = "esp_wifi_portal";
 
 static httpd_handle_t server = NULL;
-static EventGroupHandle_t wifi_event_group = NULL;
 
 static bool is_webserver_started = false;
 
-// HTTP GET Handler
-static esp_err_t root_get_handler(httpd_req_t* req)
+// Copy of the scan cache used while serializing, only touched from the httpd task
+static wifi_ap_record_t scan_records[CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN];
+
+// The built-in page split around ROOT_SCAN_MARKER, plain and gzip-compressed
+typedef struct
 {
-    const int root_len = root_end - root_start;
+    const char* head;
+    size_t head_len;
+    const char* tail;
+    size_t tail_len;
+    const char* gz_head;
+    size_t gz_head_len;
+    const char* gz_tail;
+    size_t gz_tail_len;
+    uint32_t head_crc;      // CRC-32 of the plain head, the gzip trailer continues from it
+    uint32_t page_crc;      // CRC-32 of head and tail, identifies the page in the ETag
+} root_page_t;
 
-    ESP_LOGI(TAG, "Serve root");
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, root_start, root_len);
+static root_page_t root_page;
 
-    return ESP_OK;
+// Scan results inlined into the page, only touched from the httpd task
+typedef struct
+{
+    httpd_req_t* req;
+    bool gzip;
+    uint32_t crc;           // CRC-32 of the plain bytes sent so far
+    uint32_t size;
+    char block[5 + JSON_STREAM_BUF_SIZE];
+} root_stream_t;
+
+static root_stream_t root_stream;
+
+/*
+    Whether the client lists gzip in Accept-Encoding without refusing it with q=0
+*/
+static bool accepts_gzip(httpd_req_t* req)
+{
+    char accept_encoding[64];
+    // A truncated value still holds the first encodings, browsers list gzip early
+    const esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept_encoding,
+                                                      sizeof(accept_encoding));
+    if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC)
+    {
+        return false;
+    }
+    const char* gzip = strstr(accept_encoding, "gzip");
+    if (gzip == NULL)
+    {
+        return false;
+    }
+    // "gzip;q=0", or q=0.0 and so on, refuses it
+    const char* param = gzip + strlen("gzip");
+    param += strspn(param, " ;");
+    if (strncmp(param, "q=0", 3) != 0)
+    {
+        return true;
+    }
+    param += 3;
+    param += strspn(param, ".0");
+    return *param != '\0' && *param != ',' && *param != ' ';
 }
 
-/* 扫描并返回 JSON */
-static esp_err_t wifi_scan_get_handler(httpd_req_t* req)
+#if CONFIG_ESP_WIFI_PORTAL_ASSET_BUNDLE
+/*
+    Serve an asset straight from mapped flash. Returns ESP_ERR_NOT_SUPPORTED, without sending anything, for a
+    compressed asset the client does not accept.
+*/
+static esp_err_t send_asset(httpd_req_t* req, const asset_bundle_entry_t* asset)
 {
-    uint16_t ap_count = 0;
-#ifdef USE_CHANNEL_BIT_MAP
-    wifi_scan_config_t* scan_config = (wifi_scan_config_t*)calloc(1, sizeof(wifi_scan_config_t));
-    if (!scan_config)
+    if (asset->gzip && !accepts_gzip(req))
     {
-        ESP_LOGE(TAG, "Memory Allocation for scan config failed!");
-        return ESP_FAIL;
+        return ESP_ERR_NOT_SUPPORTED;
     }
-    array_2_channel_bitmap(channel_list, CHANNEL_LIST_SIZE, scan_config);
-    esp_wifi_scan_start(scan_config, true);
-    free(scan_config);
-#else
-    esp_wifi_scan_start(NULL, true);
-#endif /*USE_CHANNEL_BIT_MAP*/
-    if (esp_wifi_scan_get_ap_num(&ap_count) != ESP_OK)
+
+    char etag[16];
+    char if_none_match[16];
+    snprintf(etag, sizeof(etag), "\"%08" PRIx32 "\"", asset->crc);
+    httpd_resp_set_hdr(req, "ETag", etag);
+    // The bundle can be reflashed on its own, so clients revalidate
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, etag) == 0)
     {
-        ESP_LOGE(TAG, "Failed to get AP count");
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
     }
 
-    if (ap_count == 0)
+    ESP_LOGD(TAG, "Serve asset %s", asset->path);
+    httpd_resp_set_type(req, asset->mime);
+    if (asset->gzip)
+    {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    }
+    return httpd_resp_send(req, (const char*)asset->data, (ssize_t)asset->len);
+}
+#endif
+
+static esp_err_t json_stream_chunk_flush(void* ctx, const char* data, const size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t*)ctx, data, (ssize_t)len);
+}
+
+/**
+ * @brief Serialize scan results as `{"generation":..,"age_ms":..,"scanning":..,"aps":[{..},..]}`
+ */
+static void write_scan_json(json_stream_t* js, const wifi_ap_record_t* records, const uint16_t count,
+                            const scan_cache_info_t* info)
+{
+    char bssid[18];
+
+    json_stream_raw(js, "{", 1);
+    json_stream_key(js, "generation");
+    json_stream_int(js, info->generation);
+    json_stream_raw(js, ",", 1);
+    json_stream_key(js, "age_ms");
+    json_stream_int(js, info->updated_us ? (esp_timer_get_time() - info->updated_us) / 1000 : -1);
+    json_stream_raw(js, ",", 1);
+    json_stream_key(js, "scanning");
+    json_stream_bool(js, info->scanning);
+    json_stream_raw(js, ",", 1);
+    json_stream_key(js, "aps");
+    json_stream_raw(js, "[", 1);
+    for (uint16_t i = 0; i < count; i++)
+    {
+        const wifi_ap_record_t* ap = &records[i];
+        if (i > 0)
+        {
+            json_stream_raw(js, ",", 1);
+        }
+        json_stream_raw(js, "{", 1);
+        json_stream_key(js, "ssid");
+        json_stream_strn(js, (const char*)ap->ssid, sizeof(ap->ssid));
+        json_stream_raw(js, ",", 1);
+        json_stream_key(js, "rssi");
+        json_stream_int(js, ap->rssi);
+        json_stream_raw(js, ",", 1);
+        json_stream_key(js, "channel");
+        json_stream_int(js, ap->primary);
+        json_stream_raw(js, ",", 1);
+        json_stream_key(js, "auth");
+        json_stream_int(js, ap->authmode);
+        json_stream_raw(js, ",", 1);
+        json_stream_key(js, "bssid");
+        snprintf(bssid, sizeof(bssid), "%02x:%02x:%02x:%02x:%02x:%02x",
+                 ap->bssid[0], ap->bssid[1], ap->bssid[2], ap->bssid[3], ap->bssid[4], ap->bssid[5]);
+        json_stream_str(js, bssid);
+        json_stream_raw(js, "}", 1);
+    }
+    json_stream_raw(js, "]}", 2);
+}
+
+static void root_page_init(void)
+{
+    if (root_page.head != NULL)
+    {
+        return;
+    }
+    const size_t marker_len = strlen(ROOT_SCAN_MARKER);
+    const char* marker = root_start;
+    while (marker + marker_len <= root_end && memcmp(marker, ROOT_SCAN_MARKER, marker_len) != 0)
+    {
+        marker++;
+    }
+    // The build fails without the marker, see CMakeLists.txt
+    root_page.head = root_start;
+    root_page.head_len = marker - root_start;
+    root_page.tail = marker + marker_len;
+    root_page.tail_len = root_end - root_page.tail;
+
+    uint32_t gz_head_len;
+    memcpy(&gz_head_len, root_gz_end - sizeof(gz_head_len), sizeof(gz_head_len));
+    root_page.gz_head = root_gz_start;
+    root_page.gz_head_len = gz_head_len;
+    root_page.gz_tail = root_gz_start + gz_head_len;
+    root_page.gz_tail_len = root_gz_end - sizeof(gz_head_len) - root_page.gz_tail;
+
+    root_page.head_crc = esp_rom_crc32_le(0, (const uint8_t*)root_page.head, root_page.head_len);
+    root_page.page_crc = esp_rom_crc32_le(root_page.head_crc, (const uint8_t*)root_page.tail, root_page.tail_len);
+}
+
+/*
+    Sink of the inlined scan results. In a gzip response every piece goes out as a stored deflate block between the
+    two compressed halves of the page.
+*/
+static esp_err_t root_stream_flush(void* ctx, const char* data, const size_t len)
+{
+    root_stream_t* rs = ctx;
+    rs->crc = esp_rom_crc32_le(rs->crc, (const uint8_t*)data, len);
+    rs->size += len;
+    if (!rs->gzip)
+    {
+        return httpd_resp_send_chunk(rs->req, data, (ssize_t)len);
+    }
+    // Not final, stored, then LEN and NLEN
+    rs->block[0] = 0x00;
+    rs->block[1] = len & 0xFF;
+    rs->block[2] = len >> 8;
+    rs->block[3] = ~len & 0xFF;
+    rs->block[4] = (~len >> 8) & 0xFF;
+    memcpy(rs->block + 5, data, len);
+    return httpd_resp_send_chunk(rs->req, rs->block, (ssize_t)(len + 5));
+}
+
+// HTTP GET Handler
+static esp_err_t root_get_handler(httpd_req_t* req)
+{
+#if CONFIG_ESP_WIFI_PORTAL_ASSET_BUNDLE
+    // A bundle with an index page replaces the page built into the firmware
+    asset_bundle_entry_t index;
+    if (asset_bundle_find("/index.html", strlen("/index.html"), &index) &&
+        send_asset(req, &index) != ESP_ERR_NOT_SUPPORTED)
     {
-        // 没有扫描到AP，返回空数组
-        const char* empty_json = "[]";
-        httpd_resp_set_type(req, "application/json");
-        httpd_resp_sendstr(req, empty_json);
         return ESP_OK;
     }
+#endif
+    root_page_init();
+
+    // The page carries the scan results, so the ETag changes with them like the one of /scan
+    const bool gzip = accepts_gzip(req);
+    scan_cache_info_t info;
+    char etag[48];
+    char if_none_match[48];
+    scan_cache_get_info(&info);
+    snprintf(etag, sizeof(etag), "\"root-%08" PRIx32 "-%" PRIu32 "%s%s\"", root_page.page_crc, info.generation,
+             info.scanning ? "s" : "", gzip ? "-gz" : "");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, etag) == 0)
+    {
+        ESP_LOGD(TAG, "Root not modified");
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", etag);
+        return httpd_resp_send(req, NULL, 0);
+    }
 
+    const uint16_t ap_count = scan_cache_get(scan_records, CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN, &info);
+    snprintf(etag, sizeof(etag), "\"root-%08" PRIx32 "-%" PRIu32 "%s%s\"", root_page.page_crc, info.generation,
+             info.scanning ? "s" : "", gzip ? "-gz" : "");
+    httpd_resp_set_hdr(req, "ETag", etag);
 
-    wifi_ap_record_t* ap_records = calloc(CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN, sizeof(wifi_ap_record_t));
-    if (!ap_records)
+    ESP_LOGI(TAG, "Serve root%s with %d networks", gzip ? " (gzip)" : "", ap_count);
+    httpd_resp_set_type(req, "text/html");
+    if (gzip)
     {
-        ESP_LOGE(TAG, "Memory allocation for AP records failed!");
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
     }
 
-    // 获取AP记录
-    uint16_t ap_limit_num = CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN;
-    if (esp_wifi_scan_get_ap_records(&ap_limit_num, ap_records) != ESP_OK)
+    root_stream_t* rs = &root_stream;
+    rs->req = req;
+    rs->gzip = gzip;
+    rs->crc = root_page.head_crc;
+    rs->size = root_page.head_len;
+    esp_err_t err = gzip ? httpd_resp_send_chunk(req, root_page.gz_head, (ssize_t)root_page.gz_head_len)
+                         : httpd_resp_send_chunk(req, root_page.head, (ssize_t)root_page.head_len);
+    if (err == ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to get AP records");
-        free(ap_records);
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
+        json_stream_t js;
+        json_stream_init(&js, root_stream_flush, rs);
+        write_scan_json(&js, scan_records, ap_count, &info);
+        err = json_stream_finish(&js);
+    }
+    if (err == ESP_OK)
+    {
+        err = gzip ? httpd_resp_send_chunk(req, root_page.gz_tail, (ssize_t)root_page.gz_tail_len)
+                   : httpd_resp_send_chunk(req, root_page.tail, (ssize_t)root_page.tail_len);
+    }
+    if (err == ESP_OK && gzip)
+    {
+        // The trailer covers the whole plain page, scan results included
+        const uint32_t crc = esp_rom_crc32_le(rs->crc, (const uint8_t*)root_page.tail, root_page.tail_len);
+        const uint32_t size = rs->size + root_page.tail_len;
+        const uint8_t trailer[8] = {
+            crc & 0xFF, (crc >> 8) & 0xFF, (crc >> 16) & 0xFF, crc >> 24,
+            size & 0xFF, (size >> 8) & 0xFF, (size >> 16) & 0xFF, size >> 24
+        };
+        err = httpd_resp_send_chunk(req, (const char*)trailer, sizeof(trailer));
     }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to send root, err: %d", err);
+        return err;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
 
-    // 记录扫描结果信息
-    ESP_LOGI(TAG, "Total APs scanned = %u, actual AP number retrieved = %u", ap_count,
-             CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN);
+/* 从扫描缓存返回 JSON */
+static esp_err_t send_scan_response(httpd_req_t* req)
+{
+    // The ETag also carries the scanning flag so a client waiting for a refresh is not served a stale body
+    scan_cache_info_t info;
+    char etag[24];
+    char if_none_match[24];
+    scan_cache_get_info(&info);
+    snprintf(etag, sizeof(etag), "\"scan-%" PRIu32 "%s\"", info.generation, info.scanning ? "s" : "");
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, etag) == 0)
+    {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_set_hdr(req, "ETag", etag);
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+
+    const uint16_t ap_count = scan_cache_get(scan_records, CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN, &info);
+    snprintf(etag, sizeof(etag), "\"scan-%" PRIu32 "%s\"", info.generation, info.scanning ? "s" : "");
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
 
-    // 创建JSON数组
-    cJSON* root = cJSON_CreateArray();
-    if (!root)
+    json_stream_t js;
+    json_stream_init(&js, json_stream_chunk_flush, req);
+    write_scan_json(&js, scan_records, ap_count, &info);
+    const esp_err_t err = json_stream_finish(&js);
+    if (err != ESP_OK)
     {
-        ESP_LOGE(TAG, "Failed to create JSON root");
-        free(ap_records);
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
+        ESP_LOGW(TAG, "Failed to send scan results, err: %d", err);
+        return err;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static void write_status_json(json_stream_t* js, const portal_connect_status_t* status)
+{
+    char ip[16];
+
+    json_stream_raw(js, "{", 1);
+    json_stream_key(js, "attempt");
+    json_stream_int(js, status->attempt);
+    json_stream_raw(js, ",", 1);
+    json_stream_key(js, "seq");
+    json_stream_int(js, status->seq);
+    json_stream_raw(js, ",", 1);
+    json_stream_key(js, "stage");
+    json_stream_str(js, portal_connect_stage_name(status->stage));
+    json_stream_raw(js, ",", 1);
+    json_stream_key(js, "success");
+    json_stream_bool(js, status->stage == PORTAL_CONNECT_GOT_IP);
+    if (status->stage == PORTAL_CONNECT_GOT_IP)
+    {
+        snprintf(ip, sizeof(ip), IPSTR, IP2STR(&status->ip));
+        json_stream_raw(js, ",", 1);
+        json_stream_key(js, "ip");
+        json_stream_str(js, ip);
+    }
+    if (status->stage == PORTAL_CONNECT_FAILED)
+    {
+        json_stream_raw(js, ",", 1);
+        json_stream_key(js, "failed_stage");
+        json_stream_str(js, portal_connect_stage_name(status->failed_stage));
+        json_stream_raw(js, ",", 1);
+        json_stream_key(js, "reason");
+        json_stream_int(js, status->reason);
     }
+    json_stream_raw(js, ",", 1);
+    json_stream_key(js, "message");
+    json_stream_str(js, status->message);
+    json_stream_raw(js, "}", 1);
+}
 
-    // 添加SSID到JSON数组
-    for (int i = 0; i < CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN; i++)
+static esp_err_t send_status_response(httpd_req_t* req)
+{
+    portal_connect_status_t status;
+    portal_connect_get_status(&status);
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    json_stream_t js;
+    json_stream_init(&js, json_stream_chunk_flush, req);
+    write_status_json(&js, &status);
+    const esp_err_t err = json_stream_finish(&js);
+    if (err != ESP_OK)
     {
-        ESP_LOGI(TAG, "SSID \t\t%s", ap_records[i].ssid);
-        ESP_LOGI(TAG, "RSSI \t\t%d", ap_records[i].rssi);
-        ESP_LOGI(TAG, "Channel \t\t%d", ap_records[i].primary);
-        if (ap_records[i].ssid[0] != '\0')
+        return err;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+#if ASYNC_REQ_SUPPORTED
+/*
+ * Requests that want to wait for something (a scan in flight, a connect status change) are parked as async
+ * requests and answered from the httpd task once it happens, so they never hold the httpd task while waiting.
+ */
+static httpd_req_t* scan_waiters[PARKED_REQ_MAX];
+static httpd_req_t* status_waiters[PARKED_REQ_MAX];
+static esp_timer_handle_t long_poll_timer = NULL;
+
+static bool park_request(httpd_req_t** slots, httpd_req_t* req)
+{
+    for (int i = 0; i < PARKED_REQ_MAX; i++)
+    {
+        if (slots[i] == NULL)
         {
-            cJSON_AddItemToArray(root, cJSON_CreateString((const char*)ap_records[i].ssid));
+            if (httpd_req_async_handler_begin(req, &slots[i]) == ESP_OK)
+            {
+                return true;
+            }
+            slots[i] = NULL;
+            return false;
         }
     }
+    return false;
+}
 
-    // 生成JSON字符串
-    const char* json_str = cJSON_PrintUnformatted(root);
-    if (!json_str)
+static void unpark_requests(httpd_req_t** slots, esp_err_t (*respond)(httpd_req_t* req))
+{
+    for (int i = 0; i < PARKED_REQ_MAX; i++)
     {
-        ESP_LOGE(TAG, "Failed to print JSON");
-        cJSON_Delete(root);
-        free(ap_records);
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
+        if (slots[i] != NULL)
+        {
+            respond(slots[i]);
+            httpd_req_async_handler_complete(slots[i]);
+            slots[i] = NULL;
+        }
     }
+}
 
-    // 发送JSON响应
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_sendstr(req, json_str);
+static esp_err_t send_unavailable(httpd_req_t* req)
+{
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    return httpd_resp_send(req, NULL, 0);
+}
 
-    // 清理资源
-    cJSON_Delete(root);
-    free((void*)json_str);
-    free(ap_records);
+static void scan_waiters_flush(void* arg)
+{
+    unpark_requests(scan_waiters, send_scan_response);
+}
 
-    return ESP_OK;
+static void status_waiters_flush(void* arg)
+{
+    unpark_requests(status_waiters, send_status_response);
 }
 
-static esp_err_t connect_post_handler(httpd_req_t* req)
+/*
+    Answers every parked request with a 503 on the httpd task, the only task that walks the slots
+*/
+static void waiters_release(void* arg)
 {
-    char buf[256];
-    const int ret = httpd_req_recv(req, buf, sizeof(buf) - 1);
-    if (ret <= 0) return ESP_FAIL;
-    buf[ret] = '\0';
+    unpark_requests(scan_waiters, send_unavailable);
+    unpark_requests(status_waiters, send_unavailable);
+    xSemaphoreGive((SemaphoreHandle_t)arg);
+}
 
-    cJSON* root = cJSON_Parse(buf);
-    if (!root) return ESP_FAIL;
-    const char* ssid = cJSON_GetObjectItem(root, "ssid")->valuestring;
-    const char* password = cJSON_GetObjectItem(root, "password")->valuestring;
+static void long_poll_timer_callback(void* arg)
+{
+    if (is_webserver_started)
+    {
+        httpd_queue_work(server, status_waiters_flush, NULL);
+    }
+}
+#endif
 
-    ESP_LOGI(TAG, "SSID: %s, Password: %s", ssid, password);
+#if CONFIG_ESP_WIFI_PORTAL_WS_PUSH
+/*
+ * WebSocket push channel on /ws. Every scan update and connect status change is pushed to all connected clients as
+ * {"type":"scan"|"status","data":{...}}, the same documents /scan and /status return.
+ */
+static int ws_clients[WS_CLIENTS_MAX];
 
-    // notice: ssid 最长 32 字节，前端要拦截
-    wifi_config_t wifi_sta_config = {0};
+typedef enum {
+    WS_PUSH_SCAN = 1,
+    WS_PUSH_STATUS,
+} ws_push_t;
 
-    strcpy((char*)wifi_sta_config.sta.ssid, (const char*)ssid);
-    strcpy((char*)wifi_sta_config.sta.password, (const char*)password);
+typedef struct ws_stream_ctx {
+    httpd_handle_t hd;
+    int fd;
+    bool first;
+} ws_stream_ctx_t;
 
-    ESP_LOGI(TAG, "SSID: %s, Password: %s", wifi_sta_config.sta.ssid, wifi_sta_config.sta.password);
+static void ws_clients_reset(void)
+{
+    for (int i = 0; i < WS_CLIENTS_MAX; i++)
+    {
+        ws_clients[i] = -1;
+    }
+}
 
-    esp_wifi_disconnect();
+static esp_err_t ws_stream_flush(void* ctx, const char* data, const size_t len)
+{
+    ws_stream_ctx_t* ws = ctx;
+    httpd_ws_frame_t frame = {
+        .final = false,
+        .fragmented = true,
+        .type = ws->first ? HTTPD_WS_TYPE_TEXT : HTTPD_WS_TYPE_CONTINUE,
+        .payload = (uint8_t*)data,
+        .len = len
+    };
+    ws->first = false;
+    return httpd_ws_send_frame_async(ws->hd, ws->fd, &frame);
+}
 
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config));
+/*
+    Streams one message as a fragmented text frame, must run in the httpd task
+*/
+static esp_err_t ws_send(httpd_handle_t hd, const int fd, const ws_push_t what)
+{
+    ws_stream_ctx_t ctx = {.hd = hd, .fd = fd, .first = true};
+    json_stream_t js;
+    json_stream_init(&js, ws_stream_flush, &ctx);
 
-    esp_wifi_connect();
+    if (what == WS_PUSH_SCAN)
+    {
+        scan_cache_info_t info;
+        const uint16_t ap_count = scan_cache_get(scan_records, CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN, &info);
+        json_stream_lit(&js, "{\"type\":\"scan\",\"data\":");
+        write_scan_json(&js, scan_records, ap_count, &info);
+    }
+    else
+    {
+        portal_connect_status_t status;
+        portal_connect_get_status(&status);
+        json_stream_lit(&js, "{\"type\":\"status\",\"data\":");
+        write_status_json(&js, &status);
+    }
+    json_stream_raw(&js, "}", 1);
+    esp_err_t err = json_stream_finish(&js);
+    if (err == ESP_OK)
+    {
+        httpd_ws_frame_t frame = {
+            .final = true,
+            .fragmented = true,
+            .type = HTTPD_WS_TYPE_CONTINUE,
+            .payload = NULL,
+            .len = 0
+        };
+        err = httpd_ws_send_frame_async(hd, fd, &frame);
+    }
+    return err;
+}
 
-    const char* resp;
-    httpd_resp_set_type(req, "application/json");
-    const EventBits_t bits = xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, pdTRUE, pdTRUE,
-                                                 pdMS_TO_TICKS(10000));
-    if (bits & WIFI_CONNECTED_BIT)
+static void ws_push(void* arg)
+{
+    const ws_push_t what = (ws_push_t)(uintptr_t)arg;
+    for (int i = 0; i < WS_CLIENTS_MAX; i++)
     {
-        resp = "{\"success\":true,\"message\":\"\"}";
-        ESP_LOGI(TAG, "Connected to the network");
+        if (ws_clients[i] >= 0)
+        {
+            if (httpd_ws_get_fd_info(server, ws_clients[i]) != HTTPD_WS_CLIENT_WEBSOCKET ||
+                ws_send(server, ws_clients[i], what) != ESP_OK)
+            {
+                ws_clients[i] = -1;
+            }
+        }
+    }
+}
+
+static void ws_queue_push(const ws_push_t what)
+{
+    httpd_queue_work(server, ws_push, (void*)(uintptr_t)what);
+}
+
+static void ws_close_fn(httpd_handle_t hd, const int sockfd)
+{
+    for (int i = 0; i < WS_CLIENTS_MAX; i++)
+    {
+        if (ws_clients[i] == sockfd)
+        {
+            ws_clients[i] = -1;
+        }
+    }
+    close(sockfd);
+}
+
+static esp_err_t ws_handler(httpd_req_t* req)
+{
+    if (req->method == HTTP_GET)
+    {
+        // Handshake done, register the client and bring it up to date
+        const int fd = httpd_req_to_sockfd(req);
+        for (int i = 0; i < WS_CLIENTS_MAX; i++)
+        {
+            if (ws_clients[i] < 0)
+            {
+                ws_clients[i] = fd;
+                ws_send(req->handle, fd, WS_PUSH_SCAN);
+                ws_send(req->handle, fd, WS_PUSH_STATUS);
+                return ESP_OK;
+            }
+        }
+        ESP_LOGW(TAG, "Too many push clients");
+        return ESP_FAIL;
+    }
+
+    // Clients have nothing to tell us, drain and drop whatever they send
+    uint8_t buf[16];
+    httpd_ws_frame_t frame = {.payload = buf};
+    return httpd_ws_recv_frame(req, &frame, sizeof(buf));
+}
+#endif
+
+static esp_err_t wifi_scan_get_handler(httpd_req_t* req)
+{
+    char query[32];
+    char value[8];
+    bool refresh = false;
+    bool wait = false;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK)
+    {
+        refresh = httpd_query_key_value(query, "refresh", value, sizeof(value)) == ESP_OK;
+        wait = httpd_query_key_value(query, "wait", value, sizeof(value)) == ESP_OK;
+    }
+
+    if ((refresh || wait) && scan_cache_request() == ESP_OK)
+    {
+#if ASYNC_REQ_SUPPORTED
+        // Join the scan in flight, the response is sent from scan_waiters_flush()
+        if (wait && park_request(scan_waiters, req))
+        {
+            return ESP_OK;
+        }
+#endif
+    }
+
+    return send_scan_response(req);
+}
+
+/*
+    GET /status[?since=<seq>]
+    With `since` equal to the current seq the request is held until the status changes or the long poll times out.
+*/
+static esp_err_t status_get_handler(httpd_req_t* req)
+{
+    char query[32];
+    char value[12];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "since", value, sizeof(value)) == ESP_OK)
+    {
+        portal_connect_status_t status;
+        portal_connect_get_status(&status);
+        if (strtoul(value, NULL, 10) == status.seq)
+        {
+#if ASYNC_REQ_SUPPORTED
+            if (park_request(status_waiters, req))
+            {
+                if (!esp_timer_is_active(long_poll_timer))
+                {
+                    esp_timer_start_once(long_poll_timer, STATUS_LONG_POLL_MS * 1000ULL);
+                }
+                return ESP_OK;
+            }
+#endif
+        }
+    }
+    return send_status_response(req);
+}
+
+/*
+    Answer a connect request. A form posted without JS gets a small page instead of the JSON the portal page reads.
+*/
+static esp_err_t send_connect_response(httpd_req_t* req, const bool form, const esp_err_t err, const uint32_t attempt,
+                                       const char* message)
+{
+    char resp[320];
+    httpd_resp_set_status(req, err == ESP_OK ? "202 Accepted" : err == ESP_ERR_INVALID_ARG ? HTTPD_400 :
+                          err == ESP_ERR_INVALID_SIZE ? "413 Payload Too Large" : HTTPD_500);
+    if (form)
+    {
+        snprintf(resp, sizeof(resp),
+                 "<!DOCTYPE html><html><head><meta charset=\"UTF-8\"><meta name=\"viewport\" "
+                 "content=\"width=device-width,initial-scale=1.0\"><title>Wi-Fi Setup</title></head><body><p>%s</p>"
+                 "<a href=\"/\">Back</a></body></html>",
+                 err == ESP_OK ? "Connecting, the device joins the network now." : message);
+        httpd_resp_set_type(req, "text/html");
     }
     else
     {
-        resp = "{\"success\":false,\"message\":\"Failed to connect to the network\"}";
-        ESP_LOGI(TAG, "Failed to connect to the network");
+        snprintf(resp, sizeof(resp), "{\"success\":%s,\"attempt\":%" PRIu32 ",\"message\":\"%s\"}",
+                 err == ESP_OK ? "true" : "false", attempt, message);
+        httpd_resp_set_type(req, "application/json");
     }
+    return httpd_resp_sendstr(req, resp);
+}
 
-    httpd_resp_send(req, resp, (ssize_t)strlen(resp));
-    cJSON_Delete(root);
-    return ESP_OK;
+static esp_err_t connect_post_handler(httpd_req_t* req)
+{
+    char content_type[48];
+    const esp_err_t hdr_err = httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type));
+    const bool form = (hdr_err == ESP_OK || hdr_err == ESP_ERR_HTTPD_RESULT_TRUNC) &&
+        strncasecmp(content_type, "application/x-www-form-urlencoded",
+                    strlen("application/x-www-form-urlencoded")) == 0;
+
+    if (req->content_len > CONNECT_BODY_MAX)
+    {
+        ESP_LOGW(TAG, "Connect request of %u bytes refused", (unsigned)req->content_len);
+        return send_connect_response(req, form, ESP_ERR_INVALID_SIZE, 0, "Request body too large");
+    }
+
+    // The body is parsed as it arrives, straight into the config
+    wifi_config_t wifi_sta_config = {0};
+    connect_parser_t parser;
+    connect_parser_init(&parser, form ? CONNECT_PARSER_FORM : CONNECT_PARSER_JSON, &wifi_sta_config.sta);
+    esp_err_t err = ESP_OK;
+    size_t remaining = req->content_len;
+    int timeouts = 0;
+    char buf[64];
+    while (err == ESP_OK && remaining > 0)
+    {
+        const int ret = httpd_req_recv(req, buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < CONNECT_RECV_TIMEOUTS)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return ESP_FAIL;
+        }
+        remaining -= ret;
+        err = connect_parser_feed(&parser, buf, ret);
+    }
+    if (err == ESP_OK)
+    {
+        err = connect_parser_finish(&parser);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Bad connect request, err: %d", err);
+        return send_connect_response(req, form, ESP_ERR_INVALID_ARG, 0,
+                                     err == ESP_ERR_INVALID_SIZE ? "SSID or password is too long" :
+                                     err == ESP_ERR_NOT_FOUND ? "SSID required" : "Malformed request");
+    }
+
+    // The SSID fills all 32 bytes of the config without a terminator at most
+    char ssid[sizeof(wifi_sta_config.sta.ssid) + 1] = {0};
+    memcpy(ssid, wifi_sta_config.sta.ssid, sizeof(wifi_sta_config.sta.ssid));
+    ESP_LOGI(TAG, "Connect to SSID: %s%s", ssid, parser.hidden ? " (hidden)" : "");
+
+    // Check against the last scan first, so a typo or a network out of range is reported at once. A hidden network is
+    // not in the scan, so only its password is checked.
+    scan_cache_info_t info;
+    scan_cache_get_info(&info);
+    wifi_ap_record_t target;
+    const bool found = scan_cache_find(ssid, &target);
+    // A posted BSSID the scan did not find may be on any channel. Rather than pin it to a channel it may not be on,
+    // the join scans all channels for any BSS of the network.
+    const bool other_bss = found && wifi_sta_config.sta.bssid_set &&
+        memcmp(target.bssid, wifi_sta_config.sta.bssid, sizeof(target.bssid)) != 0;
+    if (other_bss)
+    {
+        ESP_LOGW(TAG, "BSSID " MACSTR " not in the last scan, joining any BSS of the network",
+                 MAC2STR(wifi_sta_config.sta.bssid));
+        wifi_sta_config.sta.bssid_set = false;
+        memset(wifi_sta_config.sta.bssid, 0, sizeof(wifi_sta_config.sta.bssid));
+        wifi_sta_config.sta.channel = 0;
+    }
+    const char* rejected = !found && !parser.hidden && info.updated_us != 0 ? "Network not found" :
+        portal_connect_check(&wifi_sta_config, found ? &target : NULL);
+
+    // The attempt runs on the connect state machine, progress is reported by /status. The softAP moves to the
+    // target's channel ahead of the join so this client stays attached.
+    uint32_t attempt = 0;
+    if (rejected != NULL)
+    {
+        ESP_LOGI(TAG, "Connect rejected: %s", rejected);
+        portal_connect_reject(rejected, &attempt);
+        err = ESP_ERR_INVALID_ARG;
+    }
+    else
+    {
+        const uint8_t channel = other_bss ? 0 : wifi_sta_config.sta.channel != 0 ? wifi_sta_config.sta.channel :
+            found ? target.primary : 0;
+        err = portal_connect_start(&wifi_sta_config, channel, &attempt);
+    }
+    return send_connect_response(req, form, err, attempt, rejected ? rejected : "");
 }
 
 static const httpd_uri_t root = {
@@ -189,6 +837,23 @@ static const httpd_uri_t scan_uri = {
     .user_ctx = NULL
 };
 
+static const httpd_uri_t status_uri = {
+    .uri = "/status",
+    .method = HTTP_GET,
+    .handler = status_get_handler,
+    .user_ctx = NULL
+};
+
+#if CONFIG_ESP_WIFI_PORTAL_WS_PUSH
+static const httpd_uri_t ws_uri = {
+    .uri = "/ws",
+    .method = HTTP_GET,
+    .handler = ws_handler,
+    .user_ctx = NULL,
+    .is_websocket = true
+};
+#endif
+
 static const httpd_uri_t connect_uri = {
     .uri = "/connect",
     .method = HTTP_POST,
@@ -199,6 +864,12 @@ static const httpd_uri_t connect_uri = {
 // HTTP Error (404) Handler - Redirects all requests to the root page
 esp_err_t http_404_error_handler(httpd_req_t* req, httpd_err_code_t err)
 {
+    // OS connectivity probes make up most of these, they get a prebuilt response
+    if (captive_probe_handle(req))
+    {
+        return ESP_OK;
+    }
+
     // Set status
     httpd_resp_set_status(req, "302 Temporary Redirect");
     // Redirect to the "/" root directory
@@ -206,29 +877,101 @@ esp_err_t http_404_error_handler(httpd_req_t* req, httpd_err_code_t err)
     // iOS requires content in the response to detect a captive portal, simply redirecting is not sufficient.
     httpd_resp_send(req, "Redirect to the captive portal", HTTPD_RESP_USE_STRLEN);
 
-    ESP_LOGI(TAG, "Redirecting to root");
+    ESP_LOGD(TAG, "Redirecting to root");
     return ESP_OK;
 }
 
-esp_err_t start_webserver(EventGroupHandle_t event_group)
+#if CONFIG_ESP_WIFI_PORTAL_ASSET_BUNDLE
+/*
+    Everything no other handler takes: an asset from the bundle, otherwise the captive portal redirect
+*/
+static esp_err_t asset_get_handler(httpd_req_t* req)
+{
+    asset_bundle_entry_t asset;
+    if (asset_bundle_find(req->uri, strcspn(req->uri, "?#"), &asset))
+    {
+        if (send_asset(req, &asset) != ESP_ERR_NOT_SUPPORTED)
+        {
+            return ESP_OK;
+        }
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Asset is only available gzip-compressed");
+    }
+    return http_404_error_handler(req, HTTPD_404_NOT_FOUND);
+}
+
+static const httpd_uri_t asset_uri = {
+    .uri = "/*",
+    .method = HTTP_GET,
+    .handler = asset_get_handler,
+    .user_ctx = NULL
+};
+#endif
+
+esp_err_t start_webserver(void)
 {
     if (is_webserver_started)
     {
         ESP_LOGE(TAG, "Webserver is already started");
         return ESP_FAIL;
     }
-    if (event_group == NULL)
+#if ASYNC_REQ_SUPPORTED
+    if (long_poll_timer == NULL)
     {
-        ESP_LOGE(TAG, "Event group is NULL");
-        return ESP_FAIL;
+        const esp_timer_create_args_t timer_args = {
+            .callback = long_poll_timer_callback,
+            .name = "portal_long_poll"
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &long_poll_timer));
+    }
+#endif
+    esp_netif_ip_info_t ap_ip_info = {0};
+    esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_AP_DEF"), &ap_ip_info);
+    if (captive_probe_init(ap_ip_info.ip.addr) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Captive probes get the generic redirect");
     }
-    wifi_event_group = event_group;
+
+    // Sockets and timeouts come from the profile selected in menuconfig
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_open_sockets = 3;
+    config.max_open_sockets = CONFIG_ESP_WIFI_PORTAL_HTTPD_MAX_SOCKETS;
+    config.backlog_conn = CONFIG_ESP_WIFI_PORTAL_HTTPD_BACKLOG;
+    config.recv_wait_timeout = CONFIG_ESP_WIFI_PORTAL_HTTPD_RECV_TIMEOUT_SEC;
+    config.send_wait_timeout = CONFIG_ESP_WIFI_PORTAL_HTTPD_SEND_TIMEOUT_SEC;
+    config.stack_size = CONFIG_ESP_WIFI_PORTAL_HTTPD_STACK_SIZE;
     config.lru_purge_enable = true;
+    // Beyond this, httpd_start() fails or the DNS server finds no socket left
+    if (config.max_open_sockets > HTTPD_CONNECTIONS_MAX)
+    {
+        ESP_LOGW(TAG, "%d web server connections do not fit LWIP_MAX_SOCKETS, using %d",
+                 config.max_open_sockets, HTTPD_CONNECTIONS_MAX);
+        config.max_open_sockets = HTTPD_CONNECTIONS_MAX;
+    }
+#if CONFIG_ESP_WIFI_PORTAL_HTTPD_KEEP_ALIVE
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    // Frees the slot of a client that left the softAP without closing its connections
+    config.keep_alive_enable = true;
+    config.keep_alive_idle = CONFIG_ESP_WIFI_PORTAL_HTTPD_KEEP_ALIVE_IDLE_SEC;
+    config.keep_alive_interval = 5;
+    config.keep_alive_count = 3;
+#else
+    ESP_LOGW(TAG, "TCP keep-alive needs ESP-IDF 5.0");
+#endif
+#endif
+#if CONFIG_ESP_WIFI_PORTAL_ASSET_BUNDLE
+    // Handlers are tried in the order they are registered, the catch-all asset handler goes last
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    if (asset_bundle_open(CONFIG_ESP_WIFI_PORTAL_ASSET_PARTITION) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Serving the built-in page only");
+    }
+#endif
+#if CONFIG_ESP_WIFI_PORTAL_WS_PUSH
+    ws_clients_reset();
+    config.close_fn = ws_close_fn;
+#endif
 
     // Start the httpd server
-    ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
+    ESP_LOGI(TAG, "Starting server on port: '%d' with %d connections", config.server_port, config.max_open_sockets);
 
     esp_err_t ret = httpd_start(&server, &config);
 
@@ -248,12 +991,34 @@ esp_err_t start_webserver(EventGroupHandle_t event_group)
             ESP_LOGE(TAG, "Failed to register scan handler, err: %d", ret);
             return ret;
         }
+        ret = httpd_register_uri_handler(server, &status_uri);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to register status handler, err: %d", ret);
+            return ret;
+        }
         ret = httpd_register_uri_handler(server, &connect_uri);
         if (ret != ESP_OK)
         {
             ESP_LOGE(TAG, "Failed to register connect handler, err: %d", ret);
             return ret;
         }
+#if CONFIG_ESP_WIFI_PORTAL_WS_PUSH
+        ret = httpd_register_uri_handler(server, &ws_uri);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to register ws handler, err: %d", ret);
+            return ret;
+        }
+#endif
+#if CONFIG_ESP_WIFI_PORTAL_ASSET_BUNDLE
+        ret = httpd_register_uri_handler(server, &asset_uri);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to register asset handler, err: %d", ret);
+            return ret;
+        }
+#endif
         ret = httpd_register_err_handler(server, HTTPD_404_NOT_FOUND, http_404_error_handler);
         if (ret != ESP_OK)
         {
@@ -265,6 +1030,32 @@ esp_err_t start_webserver(EventGroupHandle_t event_group)
     return ret;
 }
 
+void http_server_notify_scan_done(void)
+{
+    if (is_webserver_started)
+    {
+#if ASYNC_REQ_SUPPORTED
+        httpd_queue_work(server, scan_waiters_flush, NULL);
+#endif
+#if CONFIG_ESP_WIFI_PORTAL_WS_PUSH
+        ws_queue_push(WS_PUSH_SCAN);
+#endif
+    }
+}
+
+void http_server_notify_status(void)
+{
+    if (is_webserver_started)
+    {
+#if ASYNC_REQ_SUPPORTED
+        httpd_queue_work(server, status_waiters_flush, NULL);
+#endif
+#if CONFIG_ESP_WIFI_PORTAL_WS_PUSH
+        ws_queue_push(WS_PUSH_STATUS);
+#endif
+    }
+}
+
 esp_err_t stop_webserver(void)
 {
     if (!is_webserver_started)
@@ -273,12 +1064,43 @@ esp_err_t stop_webserver(void)
         return ESP_FAIL;
     }
     is_webserver_started = false;
+    captive_probe_log_stats();
+#if ASYNC_REQ_SUPPORTED
+    // Don't leave parked requests behind. The slots belong to the httpd task, so they are released there, after any
+    // flush queued before. The httpd task finishes that within its socket timeouts.
+    esp_timer_stop(long_poll_timer);
+    SemaphoreHandle_t released = xSemaphoreCreateBinary();
+    if (released != NULL && httpd_queue_work(server, waiters_release, released) == ESP_OK)
+    {
+        xSemaphoreTake(released, portMAX_DELAY);
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Failed to release parked requests");
+    }
+    if (released != NULL)
+    {
+        vSemaphoreDelete(released);
+    }
+#endif
     ESP_ERROR_CHECK(httpd_unregister_uri(server, root.uri));
     ESP_ERROR_CHECK(httpd_unregister_uri(server, scan_uri.uri));
+    ESP_ERROR_CHECK(httpd_unregister_uri(server, status_uri.uri));
     ESP_ERROR_CHECK(httpd_unregister_uri(server, connect_uri.uri));
+#if CONFIG_ESP_WIFI_PORTAL_WS_PUSH
+    ESP_ERROR_CHECK(httpd_unregister_uri(server, ws_uri.uri));
+#endif
+#if CONFIG_ESP_WIFI_PORTAL_ASSET_BUNDLE
+    ESP_ERROR_CHECK(httpd_unregister_uri(server, asset_uri.uri));
+#endif
     if (server)
     {
-        return httpd_stop(server);
+        const esp_err_t ret = httpd_stop(server);
+#if CONFIG_ESP_WIFI_PORTAL_ASSET_BUNDLE
+        // No handler is running anymore, the mapped flash can go
+        asset_bundle_close();
+#endif
+        return ret;
     }
 
     return ESP_FAIL;
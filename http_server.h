@@ -3,16 +3,24 @@
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
 
-#define WIFI_CONNECTED_BIT BIT0
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-esp_err_t start_webserver(EventGroupHandle_t event_group);
+esp_err_t start_webserver(void);
 
 esp_err_t stop_webserver(void);
 
+/**
+ * @brief Answer the /scan requests waiting for the scan that just completed
+ */
+void http_server_notify_scan_done(void);
+
+/**
+ * @brief Answer the /status long polls after the connect status changed
+ */
+void http_server_notify_status(void);
+
 #ifdef __cplusplus
 }
 #endif
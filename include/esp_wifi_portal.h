@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "esp_err.h"
 
@@ -20,6 +22,42 @@ esp_err_t esp_wifi_portal_stop(void);
 
 void esp_wifi_portal_set_auto_start(bool auto_start);
 
+/**
+ * @brief A network in the credential store
+ */
+typedef struct esp_wifi_portal_cred {
+    char ssid[33];              /**<! NUL terminated SSID */
+    char password[65];          /**<! NUL terminated password, empty for open networks */
+    uint8_t priority;           /**<! Higher is preferred when several known networks are in range */
+    uint32_t last_success;      /**<! Sequence number of the last successful connect, higher is more recent, 0 if never */
+} esp_wifi_portal_cred_t;
+
+/**
+ * @brief List the stored networks
+ *
+ * @param[out] creds Filled with up to `max` entries
+ * @param max Capacity of `creds`, CONFIG_ESP_WIFI_PORTAL_CRED_MAX fits all
+ * @param[out] count Number of entries written
+ * @return ESP_OK on success
+ */
+esp_err_t esp_wifi_portal_cred_list(esp_wifi_portal_cred_t* creds, size_t max, size_t* count);
+
+/**
+ * @brief Add a network or update the password and priority of a stored one
+ *
+ * When the store is full, the entry with the lowest priority that connected least recently is replaced.
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the SSID or password does not fit
+ */
+esp_err_t esp_wifi_portal_cred_add(const char* ssid, const char* password, uint8_t priority);
+
+/**
+ * @brief Delete a stored network
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the SSID is not stored
+ */
+esp_err_t esp_wifi_portal_cred_delete(const char* ssid);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,183 @@
+#include "json_stream.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+static void json_stream_flush_buf(json_stream_t* js)
+{
+    if (js->len > 0 && js->err == ESP_OK)
+    {
+        js->err = js->flush(js->ctx, js->buf, js->len);
+    }
+    js->len = 0;
+}
+
+static void json_stream_put(json_stream_t* js, const char c)
+{
+    if (js->len == sizeof(js->buf))
+    {
+        json_stream_flush_buf(js);
+    }
+    js->buf[js->len++] = c;
+}
+
+/*
+    Returns the length of the UTF-8 sequence starting at str, or 0 if it is not a valid one
+*/
+static size_t utf8_seq_len(const uint8_t* str, const size_t avail)
+{
+    size_t len;
+    uint8_t min = 0x80;
+    uint8_t max = 0xBF;
+
+    if (str[0] >= 0xC2 && str[0] <= 0xDF)
+    {
+        len = 2;
+    }
+    else if (str[0] >= 0xE0 && str[0] <= 0xEF)
+    {
+        len = 3;
+        if (str[0] == 0xE0) { min = 0xA0; }         // overlong
+        else if (str[0] == 0xED) { max = 0x9F; }    // surrogates
+    }
+    else if (str[0] >= 0xF0 && str[0] <= 0xF4)
+    {
+        len = 4;
+        if (str[0] == 0xF0) { min = 0x90; }         // overlong
+        else if (str[0] == 0xF4) { max = 0x8F; }    // above U+10FFFF
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (len > avail || str[1] < min || str[1] > max)
+    {
+        return 0;
+    }
+    for (size_t i = 2; i < len; i++)
+    {
+        if ((str[i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+    }
+    return len;
+}
+
+void json_stream_init(json_stream_t* js, const json_stream_flush_t flush, void* ctx)
+{
+    js->len = 0;
+    js->flush = flush;
+    js->ctx = ctx;
+    js->err = ESP_OK;
+}
+
+void json_stream_raw(json_stream_t* js, const char* data, size_t len)
+{
+    while (len > 0 && js->err == ESP_OK)
+    {
+        if (js->len == sizeof(js->buf))
+        {
+            json_stream_flush_buf(js);
+        }
+        size_t n = sizeof(js->buf) - js->len;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(js->buf + js->len, data, n);
+        js->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void json_stream_strn(json_stream_t* js, const char* str, const size_t max_len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t* s = (const uint8_t*)str;
+    size_t len = 0;
+    while (len < max_len && s[len] != '\0')
+    {
+        len++;
+    }
+
+    json_stream_put(js, '"');
+    for (size_t i = 0; i < len && js->err == ESP_OK;)
+    {
+        const uint8_t c = s[i];
+        if (c == '"' || c == '\\')
+        {
+            json_stream_put(js, '\\');
+            json_stream_put(js, (char)c);
+            i++;
+        }
+        else if (c < 0x20 || c == 0x7F || c == '<')
+        {
+            // '<' too, so a string can not close a <script> it is inlined into
+            const char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+            json_stream_raw(js, esc, sizeof(esc));
+            i++;
+        }
+        else if (c < 0x80)
+        {
+            json_stream_put(js, (char)c);
+            i++;
+        }
+        else
+        {
+            const size_t seq = utf8_seq_len(s + i, len - i);
+            if (seq > 0)
+            {
+                json_stream_raw(js, (const char*)s + i, seq);
+                i += seq;
+            }
+            else
+            {
+                // Not UTF-8, take the byte as Latin-1
+                const char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                json_stream_raw(js, esc, sizeof(esc));
+                i++;
+            }
+        }
+    }
+    json_stream_put(js, '"');
+}
+
+void json_stream_str(json_stream_t* js, const char* str)
+{
+    json_stream_strn(js, str, SIZE_MAX);
+}
+
+void json_stream_key(json_stream_t* js, const char* key)
+{
+    json_stream_str(js, key);
+    json_stream_put(js, ':');
+}
+
+void json_stream_int(json_stream_t* js, const int64_t value)
+{
+    char num[24];
+    const int len = snprintf(num, sizeof(num), "%" PRId64, value);
+    json_stream_raw(js, num, len);
+}
+
+void json_stream_bool(json_stream_t* js, const bool value)
+{
+    if (value)
+    {
+        json_stream_raw(js, "true", 4);
+    }
+    else
+    {
+        json_stream_raw(js, "false", 5);
+    }
+}
+
+esp_err_t json_stream_finish(json_stream_t* js)
+{
+    json_stream_flush_buf(js);
+    return js->err;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef JSON_STREAM_BUF_SIZE
+#define JSON_STREAM_BUF_SIZE 256
+#endif
+
+/**
+ * @brief Sink receiving the serialized bytes whenever the stream buffer is full or finished
+ */
+typedef esp_err_t (*json_stream_flush_t)(void* ctx, const char* data, size_t len);
+
+/**
+ * @brief Allocation-free JSON writer
+ *
+ * Output is collected in a small fixed buffer and handed to the flush callback in pieces, so arbitrarily long
+ * documents can be produced without building them in memory. Punctuation is written by the caller with
+ * json_stream_raw(). The first flush error is latched and all later writes become no-ops.
+ */
+typedef struct json_stream {
+    char buf[JSON_STREAM_BUF_SIZE];
+    size_t len;
+    json_stream_flush_t flush;
+    void* ctx;
+    esp_err_t err;
+} json_stream_t;
+
+void json_stream_init(json_stream_t* js, json_stream_flush_t flush, void* ctx);
+
+/**
+ * @brief Append bytes as they are
+ */
+void json_stream_raw(json_stream_t* js, const char* data, size_t len);
+
+/**
+ * @brief Append a string literal as it is
+ */
+#define json_stream_lit(js, lit) json_stream_raw((js), (lit), sizeof(lit) - 1)
+
+/**
+ * @brief Append a NUL terminated string as a quoted JSON string
+ */
+void json_stream_str(json_stream_t* js, const char* str);
+
+/**
+ * @brief Append up to `max_len` bytes (stopping at a NUL) as a quoted JSON string
+ *
+ * Quotes, backslashes, '<' and control characters are escaped, so the output can also be inlined into a <script>.
+ * Bytes that are not part of a valid UTF-8 sequence, which SSIDs may legally contain, are emitted as the Latin-1 code
+ * point of the byte so the output stays valid JSON.
+ */
+void json_stream_strn(json_stream_t* js, const char* str, size_t max_len);
+
+/**
+ * @brief Append `"key":`
+ */
+void json_stream_key(json_stream_t* js, const char* key);
+
+void json_stream_int(json_stream_t* js, int64_t value);
+
+void json_stream_bool(json_stream_t* js, bool value);
+
+/**
+ * @brief Flush what is left in the buffer
+ *
+ * @return ESP_OK if every flush succeeded, otherwise the first error
+ */
+esp_err_t json_stream_finish(json_stream_t* js);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,592 @@
+#include "portal_connect.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <esp_idf_version.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// wifi_ap_config_t.csa_count is available since ESP-IDF 5.1
+#define CSA_SUPPORTED (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0))
+
+// Beacons announcing a softAP channel switch before it happens
+#define CSA_COUNT 3
+
+static const char* TAG = "esp_wifi_portal";
+
+// The lock and both timers are created on the first init and never deleted, so a timer callback racing
+// portal_connect_deinit() always finds them. Everything below is protected by status_lock.
+static SemaphoreHandle_t status_lock = NULL;
+static esp_timer_handle_t attempt_timer = NULL;
+// Delays the station join of an attempt until the softAP finished switching channels
+static esp_timer_handle_t join_timer = NULL;
+// Between portal_connect_init() and portal_connect_deinit()
+static bool running = false;
+static portal_connect_status_t status = {0};
+static portal_connect_change_cb_t change_cb = NULL;
+static wifi_config_t join_config;
+// Attempt both timers were started for
+static uint32_t join_attempt = 0;
+static portal_connect_stats_t stats = {0};
+// Set when a softAP client disconnected during the attempt in progress
+static bool client_dropped = false;
+// Joins retried after a transient failure in the attempt in progress
+static uint8_t join_retries = 0;
+// esp_timer time the attempt in progress times out at, so a late callback of a superseded attempt is ignored
+static int64_t attempt_deadline_us = 0;
+
+// Attempt IDs keep counting across portal sessions so a stale client never mistakes an old attempt for a new one
+static uint32_t last_attempt = 0;
+
+static bool is_final(const portal_connect_stage_t stage)
+{
+    return stage == PORTAL_CONNECT_IDLE || stage == PORTAL_CONNECT_GOT_IP || stage == PORTAL_CONNECT_FAILED;
+}
+
+/*
+    Map a disconnect reason to the stage it belongs to
+*/
+static portal_connect_stage_t reason_stage(const uint8_t reason)
+{
+    switch (reason)
+    {
+    case WIFI_REASON_MIC_FAILURE:
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_GROUP_KEY_UPDATE_TIMEOUT:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+        return PORTAL_CONNECT_AUTHENTICATING;
+    default:
+        return PORTAL_CONNECT_ASSOCIATING;
+    }
+}
+
+/*
+    A terminal reason ends the attempt at once, retrying cannot fix wrong credentials
+*/
+static bool is_terminal_reason(const uint8_t reason)
+{
+    return reason_stage(reason) == PORTAL_CONNECT_AUTHENTICATING ||
+        reason == WIFI_REASON_NO_AP_FOUND_W_COMPATIBLE_SECURITY;
+}
+
+static const char* reason_message(const uint8_t reason)
+{
+    if (reason_stage(reason) == PORTAL_CONNECT_AUTHENTICATING)
+    {
+        return "Wrong password";
+    }
+    switch (reason)
+    {
+    case WIFI_REASON_NO_AP_FOUND:
+        return "Network not found";
+    case WIFI_REASON_NO_AP_FOUND_W_COMPATIBLE_SECURITY:
+        return "Network security is not supported";
+    default:
+        return "Failed to connect to the network";
+    }
+}
+
+static bool is_hex(const char* str, const size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (!isxdigit((unsigned char)str[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    Must be called with status_lock held
+*/
+static void set_stage(const portal_connect_stage_t stage, const char* message)
+{
+    status.stage = stage;
+    status.message = message;
+    status.seq++;
+    ESP_LOGI(TAG, "Connect attempt %" PRIu32 ": %s%s%s", status.attempt, portal_connect_stage_name(stage),
+             message[0] ? ", " : "", message);
+}
+
+/*
+    Must be called with status_lock held
+*/
+static void count_attempt(void)
+{
+    stats.attempts++;
+    if (!client_dropped)
+    {
+        stats.client_kept++;
+    }
+}
+
+/*
+    Must be called with status_lock held. Ends an attempt that was started.
+*/
+static void set_failed(const portal_connect_stage_t failed_stage, const char* message)
+{
+    count_attempt();
+    status.failed_stage = failed_stage;
+    set_stage(PORTAL_CONNECT_FAILED, message);
+}
+
+static void notify_change(const portal_connect_change_cb_t cb)
+{
+    if (cb)
+    {
+        cb();
+    }
+}
+
+/*
+    Must be called with status_lock held. True while the attempt the timers were started for is in progress.
+*/
+static bool timed_attempt_pending(void)
+{
+    return running && !is_final(status.stage) && status.attempt == join_attempt;
+}
+
+static void attempt_timeout_callback(void* arg)
+{
+    portal_connect_change_cb_t cb = NULL;
+    bool changed = false;
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (timed_attempt_pending() && esp_timer_get_time() >= attempt_deadline_us)
+    {
+        set_failed(status.stage, "Timed out");
+        cb = change_cb;
+        changed = true;
+    }
+    xSemaphoreGive(status_lock);
+
+    if (changed)
+    {
+        esp_wifi_disconnect();
+        notify_change(cb);
+    }
+}
+
+/*
+    Move the softAP to the channel of the target AP ahead of the join. Returns the time the switch takes, 0 if the
+    softAP stays where it is.
+*/
+static uint32_t move_ap_channel(const uint8_t channel)
+{
+    wifi_config_t ap_cfg;
+    if (channel == 0 || esp_wifi_get_config(WIFI_IF_AP, &ap_cfg) != ESP_OK || ap_cfg.ap.channel == channel)
+    {
+        return 0;
+    }
+    ESP_LOGI(TAG, "Moving softAP from channel %d to %d", ap_cfg.ap.channel, channel);
+    ap_cfg.ap.channel = channel;
+#if CSA_SUPPORTED
+    // Announce the switch in the beacons so the client follows instead of losing the AP
+    ap_cfg.ap.csa_count = CSA_COUNT;
+#endif
+    const esp_err_t err = esp_wifi_set_config(WIFI_IF_AP, &ap_cfg);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to move softAP, err: %d", err);
+        return 0;
+    }
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    stats.channel_moves++;
+    xSemaphoreGive(status_lock);
+
+    // Beacon interval is in TU (1024 us)
+    const uint32_t beacon_ms = (ap_cfg.ap.beacon_interval ? ap_cfg.ap.beacon_interval : 100) * 1024 / 1000;
+#if CSA_SUPPORTED
+    return (CSA_COUNT + 1) * beacon_ms;
+#else
+    return beacon_ms;
+#endif
+}
+
+static esp_err_t join(void)
+{
+    esp_err_t err = esp_wifi_set_config(WIFI_IF_STA, &join_config);
+    if (err == ESP_OK)
+    {
+        err = esp_wifi_connect();
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start connecting, err: %d", err);
+    }
+    return err;
+}
+
+static void join_timer_callback(void* arg)
+{
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    const bool pending = timed_attempt_pending();
+    xSemaphoreGive(status_lock);
+    if (!pending || join() == ESP_OK)
+    {
+        return;
+    }
+
+    // The attempt may have been superseded or the portal stopped while joining
+    portal_connect_change_cb_t cb = NULL;
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    const bool failed = timed_attempt_pending();
+    if (failed)
+    {
+        set_failed(PORTAL_CONNECT_ASSOCIATING, "Failed to start connecting");
+        cb = change_cb;
+    }
+    xSemaphoreGive(status_lock);
+    if (failed)
+    {
+        esp_timer_stop(attempt_timer);
+        notify_change(cb);
+    }
+}
+
+esp_err_t portal_connect_init(const portal_connect_change_cb_t on_change)
+{
+    if (status_lock == NULL)
+    {
+        status_lock = xSemaphoreCreateMutex();
+        if (status_lock == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    esp_err_t err = ESP_OK;
+    if (attempt_timer == NULL)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = attempt_timeout_callback,
+            .name = "portal_connect"
+        };
+        err = esp_timer_create(&timer_args, &attempt_timer);
+    }
+    if (err == ESP_OK && join_timer == NULL)
+    {
+        const esp_timer_create_args_t join_timer_args = {
+            .callback = join_timer_callback,
+            .name = "portal_join"
+        };
+        err = esp_timer_create(&join_timer_args, &join_timer);
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (running)
+    {
+        xSemaphoreGive(status_lock);
+        ESP_LOGE(TAG, "Connect state machine is already initialized");
+        return ESP_FAIL;
+    }
+    memset(&status, 0, sizeof(status));
+    memset(&stats, 0, sizeof(stats));
+    status.message = "";
+    change_cb = on_change;
+    running = true;
+    xSemaphoreGive(status_lock);
+    return ESP_OK;
+}
+
+void portal_connect_deinit(void)
+{
+    if (status_lock == NULL)
+    {
+        return;
+    }
+    // Timer callbacks check running under the lock, one that fires from here on does nothing
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    const bool was_running = running;
+    running = false;
+    change_cb = NULL;
+    const portal_connect_stats_t last_stats = stats;
+    xSemaphoreGive(status_lock);
+    esp_timer_stop(join_timer);
+    esp_timer_stop(attempt_timer);
+
+    if (was_running && (last_stats.attempts > 0 || last_stats.rejected > 0))
+    {
+        ESP_LOGI(TAG, "Connect attempts: %" PRIu32 ", client stayed attached: %" PRIu32 ", softAP channel moves: %"
+                 PRIu32 ", rejected before joining: %" PRIu32, last_stats.attempts, last_stats.client_kept,
+                 last_stats.channel_moves, last_stats.rejected);
+    }
+}
+
+const char* portal_connect_check(wifi_config_t* sta_config, const wifi_ap_record_t* target)
+{
+    const char* password = (const char*)sta_config->sta.password;
+    const size_t len = strnlen(password, sizeof(sta_config->sta.password));
+    if (target == NULL)
+    {
+        // Without the scan record only the lengths no network accepts can be ruled out
+        return len > 0 && len < 8 && len != 5 && len != 13 ? "Password is too short" : NULL;
+    }
+
+    switch (target->authmode)
+    {
+    case WIFI_AUTH_OPEN:
+    case WIFI_AUTH_OWE:
+        // A password typed for an open network is not an error, it is just not needed
+        memset(sta_config->sta.password, 0, sizeof(sta_config->sta.password));
+        return NULL;
+    case WIFI_AUTH_WEP:
+        if (len == 5 || len == 13 || ((len == 10 || len == 26) && is_hex(password, len)))
+        {
+            return NULL;
+        }
+        return "WEP keys are 5 or 13 characters, or 10 or 26 hex digits";
+    case WIFI_AUTH_WPA_PSK:
+    case WIFI_AUTH_WPA2_PSK:
+    case WIFI_AUTH_WPA_WPA2_PSK:
+    case WIFI_AUTH_WPA3_PSK:
+    case WIFI_AUTH_WPA2_WPA3_PSK:
+    case WIFI_AUTH_WAPI_PSK:
+        if (len == 0)
+        {
+            return "Password required";
+        }
+        if ((len >= 8 && len <= 63) || (len == 64 && is_hex(password, len)))
+        {
+            return NULL;
+        }
+        return "Passwords are 8 to 63 characters, or 64 hex digits";
+    default:
+        return "Network security is not supported";
+    }
+}
+
+esp_err_t portal_connect_reject(const char* message, uint32_t* attempt)
+{
+    if (status_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_timer_stop(attempt_timer);
+    esp_timer_stop(join_timer);
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (!running)
+    {
+        xSemaphoreGive(status_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    status.attempt = ++last_attempt;
+    status.reason = 0;
+    status.ip.addr = 0;
+    client_dropped = false;
+    // The radio never left the channel, so this is no attempt for the stats
+    stats.rejected++;
+    status.failed_stage = PORTAL_CONNECT_IDLE;
+    set_stage(PORTAL_CONNECT_FAILED, message);
+    *attempt = status.attempt;
+    const portal_connect_change_cb_t cb = change_cb;
+    xSemaphoreGive(status_lock);
+
+    notify_change(cb);
+    return ESP_OK;
+}
+
+esp_err_t portal_connect_start(const wifi_config_t* sta_config, const uint8_t channel, uint32_t* attempt)
+{
+    if (status_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_timer_stop(attempt_timer);
+    esp_timer_stop(join_timer);
+
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (!running)
+    {
+        xSemaphoreGive(status_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    status.attempt = ++last_attempt;
+    status.reason = 0;
+    status.ip.addr = 0;
+    status.failed_stage = PORTAL_CONNECT_IDLE;
+    client_dropped = false;
+    join_retries = 0;
+    attempt_deadline_us = esp_timer_get_time() + CONFIG_ESP_WIFI_PORTAL_CONNECT_TIMEOUT_MS * 1000LL;
+    set_stage(PORTAL_CONNECT_ASSOCIATING, "");
+    const uint32_t id = status.attempt;
+    join_attempt = id;
+    join_config = *sta_config;
+    // Only probe the channel the scan found the target on
+    join_config.sta.channel = channel;
+    // Every failed join is reported right away and retried here, so terminal reasons end the attempt at once. With
+    // WIFI_STORAGE_FLASH this is stored as well, every join outside the portal sets the configured count again.
+    join_config.sta.failure_retry_cnt = 0;
+    portal_connect_change_cb_t cb = change_cb;
+    xSemaphoreGive(status_lock);
+
+    esp_wifi_disconnect();
+    const uint32_t switch_ms = move_ap_channel(channel);
+    esp_err_t err = switch_ms > 0 ? esp_timer_start_once(join_timer, switch_ms * 1000ULL) : join();
+
+    if (err == ESP_OK)
+    {
+        esp_timer_start_once(attempt_timer, CONFIG_ESP_WIFI_PORTAL_CONNECT_TIMEOUT_MS * 1000ULL);
+    }
+    else
+    {
+        // Unless a newer attempt or the portal stop got there first
+        xSemaphoreTake(status_lock, portMAX_DELAY);
+        if (running && status.attempt == id && !is_final(status.stage))
+        {
+            set_failed(PORTAL_CONNECT_ASSOCIATING, "Failed to start connecting");
+        }
+        cb = change_cb;
+        xSemaphoreGive(status_lock);
+    }
+
+    notify_change(cb);
+    *attempt = id;
+    return err;
+}
+
+void portal_connect_on_event(const esp_event_base_t event_base, const int32_t event_id, void* event_data)
+{
+    if (status_lock == NULL)
+    {
+        return;
+    }
+
+    bool changed = false;
+    bool retry = false;
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (running && !is_final(status.stage))
+    {
+        if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STADISCONNECTED)
+        {
+            client_dropped = true;
+        }
+        else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED)
+        {
+            set_stage(PORTAL_CONNECT_DHCP, "");
+            changed = true;
+        }
+        else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+        {
+            const wifi_event_sta_disconnected_t* event = (const wifi_event_sta_disconnected_t*)event_data;
+            // ASSOC_LEAVE is the echo of our own esp_wifi_disconnect() before the attempt started
+            if (!(status.stage == PORTAL_CONNECT_ASSOCIATING && event->reason == WIFI_REASON_ASSOC_LEAVE))
+            {
+                status.reason = event->reason;
+                if (status.stage == PORTAL_CONNECT_ASSOCIATING && !is_terminal_reason(event->reason) &&
+                    join_retries < CONFIG_ESP_WIFI_PORTAL_STA_RETRY_CNT)
+                {
+                    join_retries++;
+                    retry = true;
+                    ESP_LOGI(TAG, "Connect attempt %" PRIu32 ": reason %d, retry %d/%d", status.attempt,
+                             event->reason, join_retries, CONFIG_ESP_WIFI_PORTAL_STA_RETRY_CNT);
+                }
+                else
+                {
+                    set_failed(status.stage == PORTAL_CONNECT_ASSOCIATING ? reason_stage(event->reason) : status.stage,
+                               reason_message(event->reason));
+                    changed = true;
+                }
+            }
+        }
+        else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+        {
+            const ip_event_got_ip_t* event = (const ip_event_got_ip_t*)event_data;
+            status.ip.addr = event->ip_info.ip.addr;
+            count_attempt();
+            set_stage(PORTAL_CONNECT_GOT_IP, "");
+            changed = true;
+        }
+    }
+    const bool done = is_final(status.stage);
+    const portal_connect_change_cb_t cb = change_cb;
+    xSemaphoreGive(status_lock);
+
+    if (done)
+    {
+        esp_timer_stop(attempt_timer);
+    }
+    if (retry)
+    {
+        esp_wifi_connect();
+    }
+    if (changed)
+    {
+        notify_change(cb);
+    }
+}
+
+void portal_connect_get_stats(portal_connect_stats_t* out)
+{
+    if (status_lock == NULL)
+    {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (running)
+    {
+        *out = stats;
+    }
+    else
+    {
+        memset(out, 0, sizeof(*out));
+    }
+    xSemaphoreGive(status_lock);
+}
+
+void portal_connect_get_status(portal_connect_status_t* out)
+{
+    if (status_lock == NULL)
+    {
+        memset(out, 0, sizeof(*out));
+        out->message = "";
+        return;
+    }
+    xSemaphoreTake(status_lock, portMAX_DELAY);
+    if (running)
+    {
+        *out = status;
+    }
+    else
+    {
+        memset(out, 0, sizeof(*out));
+        out->message = "";
+    }
+    xSemaphoreGive(status_lock);
+}
+
+const char* portal_connect_stage_name(const portal_connect_stage_t stage)
+{
+    switch (stage)
+    {
+    case PORTAL_CONNECT_IDLE:
+        return "idle";
+    case PORTAL_CONNECT_ASSOCIATING:
+        return "associating";
+    case PORTAL_CONNECT_AUTHENTICATING:
+        return "authenticating";
+    case PORTAL_CONNECT_DHCP:
+        return "dhcp";
+    case PORTAL_CONNECT_GOT_IP:
+        return "got_ip";
+    case PORTAL_CONNECT_FAILED:
+        return "failed";
+    }
+    return "unknown";
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Stages of a connect attempt started from the portal
+ *
+ * @note The driver reports association and the key handshake together (WIFI_EVENT_STA_CONNECTED), so
+ * PORTAL_CONNECT_AUTHENTICATING is only seen as the `failed_stage` of an attempt that failed during the handshake.
+ */
+typedef enum {
+    PORTAL_CONNECT_IDLE = 0,
+    PORTAL_CONNECT_ASSOCIATING,
+    PORTAL_CONNECT_AUTHENTICATING,
+    PORTAL_CONNECT_DHCP,
+    PORTAL_CONNECT_GOT_IP,
+    PORTAL_CONNECT_FAILED,
+} portal_connect_stage_t;
+
+/**
+ * @brief Snapshot of the current (or last) connect attempt
+ */
+typedef struct portal_connect_status {
+    uint32_t attempt;                       /**<! Attempt ID, 0 if no attempt was made yet */
+    uint32_t seq;                           /**<! Bumped on every change, for long polling */
+    portal_connect_stage_t stage;           /**<! Current stage */
+    portal_connect_stage_t failed_stage;    /**<! Stage the attempt was in when it failed */
+    uint8_t reason;                         /**<! Last disconnect reason (wifi_err_reason_t), 0 if none */
+    const char* message;                    /**<! Human readable failure, empty if none */
+    esp_ip4_addr_t ip;                      /**<! Station IP once PORTAL_CONNECT_GOT_IP is reached */
+} portal_connect_status_t;
+
+/**
+ * @brief Counters of the current portal session
+ */
+typedef struct portal_connect_stats {
+    uint32_t attempts;          /**<! Attempts that reached a final stage */
+    uint32_t client_kept;       /**<! Of those, attempts during which no softAP client disconnected */
+    uint32_t channel_moves;     /**<! softAP channel changes made ahead of a join */
+    uint32_t rejected;          /**<! Requests rejected by the pre-flight check, not counted as attempts */
+} portal_connect_stats_t;
+
+/**
+ * @brief Called (from the event or esp_timer task) whenever the status changes
+ */
+typedef void (*portal_connect_change_cb_t)(void);
+
+/**
+ * @brief Set up the connect state machine
+ *
+ * @param on_change Optional change callback
+ * @return ESP_OK on success
+ */
+esp_err_t portal_connect_init(portal_connect_change_cb_t on_change);
+
+/**
+ * @brief Abort any attempt in progress and stop the state machine
+ *
+ * The lock and timers stay for the next portal_connect_init(), so a timer callback running meanwhile is safe.
+ */
+void portal_connect_deinit(void);
+
+/**
+ * @brief Check a station config against the scan record of its network before joining
+ *
+ * Rules out passwords the network's auth mode cannot accept, so the client learns about a typo at once instead of
+ * after a failed handshake. A password given for an open network is cleared.
+ *
+ * @param sta_config Station config to check
+ * @param target Scan record of the network, NULL if it is not known
+ * @return NULL if the config may work, otherwise a human readable reason
+ */
+const char* portal_connect_check(wifi_config_t* sta_config, const wifi_ap_record_t* target);
+
+/**
+ * @brief Record an attempt that failed before it started, e.g. because portal_connect_check() rejected it
+ *
+ * @param message Human readable reason, must stay valid (a string literal)
+ * @param[out] attempt ID of the failed attempt
+ * @return ESP_OK on success
+ */
+esp_err_t portal_connect_reject(const char* message, uint32_t* attempt);
+
+/**
+ * @brief Start a connect attempt and return without waiting for it
+ *
+ * A new attempt supersedes the one in progress. If the target is on another channel than the softAP, the softAP
+ * moves there first (announced with a channel switch announcement where the IDF supports it) and the station joins
+ * once the switch is done, so the client that started the attempt stays attached and gets the result.
+ *
+ * Transient failures (AP not found, association timeout) are retried up to CONFIG_ESP_WIFI_PORTAL_STA_RETRY_CNT
+ * times. A terminal reason (rejected credentials, unsupported security) fails the attempt as soon as it is reported.
+ *
+ * @param sta_config Station config to connect with
+ * @param channel Channel of the target AP from the last scan, 0 if unknown
+ * @param[out] attempt ID of the new attempt
+ * @return ESP_OK if the attempt was started
+ */
+esp_err_t portal_connect_start(const wifi_config_t* sta_config, uint8_t channel, uint32_t* attempt);
+
+/**
+ * @brief Feed a WIFI_EVENT / IP_EVENT into the state machine
+ *
+ * Besides the station events, WIFI_EVENT_AP_STADISCONNECTED is used to count attempts that kept the client.
+ */
+void portal_connect_on_event(esp_event_base_t event_base, int32_t event_id, void* event_data);
+
+/**
+ * @brief Get the status of the current attempt
+ */
+void portal_connect_get_status(portal_connect_status_t* status);
+
+/**
+ * @brief Get the counters of the current portal session
+ */
+void portal_connect_get_stats(portal_connect_stats_t* stats);
+
+/**
+ * @brief Short lowercase name of a stage, as used by the /status endpoint
+ */
+const char* portal_connect_stage_name(portal_connect_stage_t stage);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,274 @@
+#include "portal_creds.h"
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "portal_store.h"
+
+static const char* TAG = "esp_wifi_portal";
+
+// Serializes the read-modify-write cycles on the store, the APIs are called from the app, httpd and event tasks
+static SemaphoreHandle_t creds_lock = NULL;
+
+// Working copy of the store, only used with creds_lock held
+static esp_wifi_portal_cred_t creds[CONFIG_ESP_WIFI_PORTAL_CRED_MAX];
+
+static int find_cred(const esp_wifi_portal_cred_t* list, const size_t count, const char* ssid)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (strcmp(list[i].ssid, ssid) == 0)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*
+    Pick the entry to replace when the store is full: lowest priority, then least recently connected
+*/
+static size_t find_evictee(const esp_wifi_portal_cred_t* list, const size_t count)
+{
+    size_t victim = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (list[i].priority < list[victim].priority ||
+            (list[i].priority == list[victim].priority && list[i].last_success < list[victim].last_success))
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+/*
+    Must be called with creds_lock held. Adds the network or updates it in place, returns its index.
+*/
+static size_t upsert_cred(size_t* count, const char* ssid, const char* password)
+{
+    int index = find_cred(creds, *count, ssid);
+    if (index < 0)
+    {
+        if (*count < CONFIG_ESP_WIFI_PORTAL_CRED_MAX)
+        {
+            index = (int)(*count)++;
+        }
+        else
+        {
+            index = (int)find_evictee(creds, *count);
+            ESP_LOGI(TAG, "Credential store full, replacing %s", creds[index].ssid);
+        }
+        memset(&creds[index], 0, sizeof(creds[index]));
+        strcpy(creds[index].ssid, ssid);
+    }
+    strcpy(creds[index].password, password);
+    return (size_t)index;
+}
+
+static bool is_valid(const char* ssid, const char* password)
+{
+    const size_t ssid_len = ssid ? strlen(ssid) : 0;
+    return ssid_len > 0 && ssid_len < sizeof(creds[0].ssid) && password &&
+        strlen(password) < sizeof(creds[0].password);
+}
+
+esp_err_t portal_creds_init(void)
+{
+    if (creds_lock == NULL)
+    {
+        creds_lock = xSemaphoreCreateMutex();
+        if (creds_lock == NULL)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+void portal_creds_deinit(void)
+{
+    if (creds_lock != NULL)
+    {
+        vSemaphoreDelete(creds_lock);
+        creds_lock = NULL;
+    }
+}
+
+esp_err_t esp_wifi_portal_cred_list(esp_wifi_portal_cred_t* out, const size_t max, size_t* count)
+{
+    *count = 0;
+    if (creds_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(creds_lock, portMAX_DELAY);
+    size_t stored = 0;
+    const esp_err_t err = portal_store_get_creds(creds, &stored);
+    if (err == ESP_OK)
+    {
+        *count = stored < max ? stored : max;
+        memcpy(out, creds, *count * sizeof(*out));
+    }
+    xSemaphoreGive(creds_lock);
+    return err;
+}
+
+esp_err_t esp_wifi_portal_cred_add(const char* ssid, const char* password, const uint8_t priority)
+{
+    if (!is_valid(ssid, password))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (creds_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(creds_lock, portMAX_DELAY);
+    size_t count = 0;
+    esp_err_t err = portal_store_get_creds(creds, &count);
+    if (err == ESP_OK)
+    {
+        creds[upsert_cred(&count, ssid, password)].priority = priority;
+        err = portal_store_set_creds(creds, count);
+    }
+    xSemaphoreGive(creds_lock);
+    return err;
+}
+
+esp_err_t esp_wifi_portal_cred_delete(const char* ssid)
+{
+    if (ssid == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (creds_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(creds_lock, portMAX_DELAY);
+    size_t count = 0;
+    esp_err_t err = portal_store_get_creds(creds, &count);
+    if (err == ESP_OK)
+    {
+        const int index = find_cred(creds, count, ssid);
+        if (index < 0)
+        {
+            err = ESP_ERR_NOT_FOUND;
+        }
+        else
+        {
+            memmove(&creds[index], &creds[index + 1], (count - index - 1) * sizeof(creds[0]));
+            err = portal_store_set_creds(creds, count - 1);
+        }
+    }
+    xSemaphoreGive(creds_lock);
+    return err;
+}
+
+/*
+    True if candidate `a` should be tried before `b`
+*/
+static bool is_better(const portal_creds_candidate_t* a, const portal_creds_candidate_t* b)
+{
+    if (a->cred.priority != b->cred.priority)
+    {
+        return a->cred.priority > b->cred.priority;
+    }
+    if (a->rssi != b->rssi)
+    {
+        return a->rssi > b->rssi;
+    }
+    return a->cred.last_success > b->cred.last_success;
+}
+
+size_t portal_creds_rank(const wifi_ap_record_t* records, const uint16_t count,
+                         portal_creds_candidate_t* candidates, const size_t max)
+{
+    if (creds_lock == NULL)
+    {
+        return 0;
+    }
+    xSemaphoreTake(creds_lock, portMAX_DELAY);
+    size_t stored = 0;
+    if (portal_store_get_creds(creds, &stored) != ESP_OK)
+    {
+        stored = 0;
+    }
+
+    size_t found = 0;
+    for (size_t i = 0; i < stored && found < max; i++)
+    {
+        // Strongest BSSID of this network whose security matches the stored password
+        const wifi_ap_record_t* best = NULL;
+        for (uint16_t j = 0; j < count; j++)
+        {
+            const wifi_ap_record_t* record = &records[j];
+            if (strncmp((const char*)record->ssid, creds[i].ssid, sizeof(record->ssid)) != 0 ||
+                (record->authmode == WIFI_AUTH_OPEN) != (creds[i].password[0] == '\0'))
+            {
+                continue;
+            }
+            if (best == NULL || record->rssi > best->rssi)
+            {
+                best = record;
+            }
+        }
+        if (best == NULL)
+        {
+            continue;
+        }
+
+        portal_creds_candidate_t candidate = {
+            .cred = creds[i],
+            .channel = best->primary,
+            .rssi = best->rssi
+        };
+        memcpy(candidate.bssid, best->bssid, sizeof(candidate.bssid));
+
+        // Insertion sort, the list holds a handful of entries
+        size_t pos = found++;
+        while (pos > 0 && is_better(&candidate, &candidates[pos - 1]))
+        {
+            candidates[pos] = candidates[pos - 1];
+            pos--;
+        }
+        candidates[pos] = candidate;
+    }
+    xSemaphoreGive(creds_lock);
+    return found;
+}
+
+void portal_creds_on_connected(const char* ssid, const char* password)
+{
+    if (creds_lock == NULL || !is_valid(ssid, password))
+    {
+        return;
+    }
+    xSemaphoreTake(creds_lock, portMAX_DELAY);
+    size_t count = 0;
+    if (portal_store_get_creds(creds, &count) == ESP_OK)
+    {
+        // Recency is a sequence number over the store, the clock is not set across reboots without SNTP
+        uint32_t latest = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (creds[i].last_success > latest)
+            {
+                latest = creds[i].last_success;
+            }
+        }
+        // A routine reconnect to the most recent network changes nothing, so the flash is not written
+        const int index = find_cred(creds, count, ssid);
+        if (index < 0 || strcmp(creds[index].password, password) != 0 || creds[index].last_success == 0 ||
+            creds[index].last_success != latest)
+        {
+            creds[upsert_cred(&count, ssid, password)].last_success = latest + 1;
+            portal_store_set_creds(creds, count);
+        }
+    }
+    xSemaphoreGive(creds_lock);
+}
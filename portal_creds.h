@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+#include "esp_wifi_portal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief A stored network that was seen by a scan
+ */
+typedef struct portal_creds_candidate {
+    esp_wifi_portal_cred_t cred;    /**<! Stored credentials */
+    uint8_t bssid[6];               /**<! Strongest BSSID of the network */
+    uint8_t channel;                /**<! Primary channel of that BSSID */
+    int8_t rssi;                    /**<! RSSI of that BSSID */
+} portal_creds_candidate_t;
+
+/**
+ * @brief Set up the credential store, the esp_wifi_portal_cred_* APIs fail before this is called
+ */
+esp_err_t portal_creds_init(void);
+
+void portal_creds_deinit(void);
+
+/**
+ * @brief Match scan results against the stored networks
+ *
+ * @param records Scan results
+ * @param count Number of scan results
+ * @param[out] candidates Stored networks in range, best first: by priority, then RSSI, then the most recent success
+ * @param max Capacity of `candidates`
+ * @return Number of candidates written
+ */
+size_t portal_creds_rank(const wifi_ap_record_t* records, uint16_t count, portal_creds_candidate_t* candidates,
+                         size_t max);
+
+/**
+ * @brief Record a successful connect, adding the network to the store if it is not known yet
+ */
+void portal_creds_on_connected(const char* ssid, const char* password);
+
+#ifdef __cplusplus
+}
+#endif
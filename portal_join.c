@@ -0,0 +1,526 @@
+#include "portal_join.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+
+#include "portal_creds.h"
+#include "portal_store.h"
+#include "scan_cache.h"
+
+static const char* TAG = "esp_wifi_portal";
+
+/*
+    How the station is joining, tried in this order until one gets an IP
+*/
+typedef enum {
+    JOIN_NONE = 0,
+    JOIN_FAST,          // BSSID/channel of the last AP from NVS
+    JOIN_SCAN,          // Scanning for stored networks
+    JOIN_CANDIDATE,     // Stored network found by the scan
+    JOIN_CONFIGURED,    // Current station config with a full scan
+    JOIN_BACKOFF,       // Waiting for the reconnect timer
+} join_method_t;
+
+static join_method_t join_method = JOIN_NONE;
+
+static esp_timer_handle_t reconnect_timer = NULL;
+
+// The join state machine runs on the default event loop only, the reconnect timer hands over with a private event
+static ESP_EVENT_DEFINE_BASE(PORTAL_JOIN_EVENT);
+enum
+{
+    PORTAL_JOIN_EVENT_RECONNECT,
+};
+
+static esp_event_handler_instance_t join_event_handler_instance = NULL;
+
+// Failed join passes since the link was lost, or since boot
+static uint32_t failed_attempts = 0;
+
+// Passes in a row that ended with the credentials being rejected
+static uint32_t auth_failures = 0;
+
+// esp_timer time the first join pass of this outage failed at, 0 while connected
+static int64_t outage_start_us = 0;
+
+// esp_timer time the current join was started at
+static int64_t join_start_us = 0;
+
+// esp_timer time the stored networks were last retried while the portal runs
+static int64_t portal_retry_us = 0;
+
+// Stored networks in range, best first, tried one after another
+static portal_creds_candidate_t candidates[CONFIG_ESP_WIFI_PORTAL_CRED_MAX];
+static size_t candidate_count = 0;
+static size_t candidate_next = 0;
+
+/*
+    What a disconnect reason says about the chances of the next attempt
+*/
+typedef enum {
+    REASON_TRANSIENT,       // AP gone or not answering, e.g. rebooting: retry with backoff
+    REASON_CREDENTIALS,     // AP rejected the credentials: retrying rarely helps
+    REASON_LOCAL,           // Disconnected on purpose by the application: leave it alone
+} reason_class_t;
+
+static reason_class_t classify_reason(const uint8_t reason)
+{
+    switch (reason)
+    {
+    case WIFI_REASON_ASSOC_LEAVE:
+        return REASON_LOCAL;
+    case WIFI_REASON_MIC_FAILURE:
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_NO_AP_FOUND_W_COMPATIBLE_SECURITY:
+        return REASON_CREDENTIALS;
+    default:
+        return REASON_TRANSIENT;
+    }
+}
+
+static const char* reason_class_name(const reason_class_t reason_class)
+{
+    switch (reason_class)
+    {
+    case REASON_CREDENTIALS:
+        return "credentials rejected";
+    case REASON_LOCAL:
+        return "local";
+    default:
+        return "transient";
+    }
+}
+
+/*
+    Exponential backoff with equal jitter: half of the delay is fixed, the other half random, so devices that lost
+    the same router do not come back in lockstep
+*/
+static uint32_t backoff_delay_ms(const uint32_t attempt)
+{
+    const uint32_t shift = attempt > 16 ? 16 : attempt - 1;
+    uint64_t delay_ms = (uint64_t)CONFIG_ESP_WIFI_PORTAL_RECONNECT_BASE_MS << shift;
+    if (delay_ms > CONFIG_ESP_WIFI_PORTAL_RECONNECT_MAX_DELAY_MS)
+    {
+        delay_ms = CONFIG_ESP_WIFI_PORTAL_RECONNECT_MAX_DELAY_MS;
+    }
+    const uint32_t half = (uint32_t)delay_ms / 2;
+    return half + esp_random() % (half + 1);
+}
+
+static const char* join_method_name(const join_method_t method)
+{
+    switch (method)
+    {
+    case JOIN_FAST:
+        return "fast join";
+    case JOIN_CANDIDATE:
+        return "scan";
+    case JOIN_CONFIGURED:
+        return "full scan";
+    case JOIN_BACKOFF:
+    default:
+        return "unknown";
+    }
+}
+
+/*
+    Point the station config at the AP it last got an IP from, so the driver probes a single channel instead of
+    scanning all of them. Returns false if there is no usable hint for the configured network.
+*/
+static bool apply_last_ap_hint(wifi_config_t* sta_cfg)
+{
+    portal_last_ap_t last_ap;
+    if (portal_store_get_last_ap(&last_ap) != ESP_OK)
+    {
+        return false;
+    }
+    if (strncmp((const char*)last_ap.ssid, (const char*)sta_cfg->sta.ssid, sizeof(sta_cfg->sta.ssid)) != 0)
+    {
+        return false;
+    }
+    // The network changed its security since, the hint is stale
+    if ((last_ap.authmode == WIFI_AUTH_OPEN) != (sta_cfg->sta.password[0] == '\0'))
+    {
+        return false;
+    }
+    sta_cfg->sta.bssid_set = true;
+    memcpy(sta_cfg->sta.bssid, last_ap.bssid, sizeof(sta_cfg->sta.bssid));
+    sta_cfg->sta.channel = last_ap.channel;
+    return true;
+}
+
+static void connect_with(wifi_config_t* sta_cfg, const join_method_t method)
+{
+    join_method = method;
+    // The portal joins with no driver retries, and esp_wifi_set_config() stored that too
+    sta_cfg->sta.failure_retry_cnt = CONFIG_ESP_WIFI_PORTAL_STA_RETRY_CNT;
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, sta_cfg));
+    esp_wifi_connect();
+}
+
+static bool join_fast(void)
+{
+    wifi_config_t sta_cfg;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &sta_cfg));
+    if (!apply_last_ap_hint(&sta_cfg))
+    {
+        return false;
+    }
+    ESP_LOGI(TAG, "Fast join to " MACSTR " on channel %d", MAC2STR(sta_cfg.sta.bssid), sta_cfg.sta.channel);
+    connect_with(&sta_cfg, JOIN_FAST);
+    return true;
+}
+
+static void join_configured(void)
+{
+    wifi_config_t sta_cfg;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &sta_cfg));
+    sta_cfg.sta.bssid_set = false;
+    sta_cfg.sta.channel = 0;
+    ESP_LOGI(TAG, "Joining %.32s with a full scan", sta_cfg.sta.ssid);
+    connect_with(&sta_cfg, JOIN_CONFIGURED);
+}
+
+static void join_scan(void)
+{
+    join_method = JOIN_SCAN;
+    const esp_err_t err = esp_wifi_scan_start(NULL, false);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to scan for known networks, err: %d", err);
+        join_configured();
+    }
+}
+
+/*
+    Try the next stored network in range, returns false once all were tried
+*/
+static bool join_next_candidate(void)
+{
+    if (candidate_next >= candidate_count)
+    {
+        return false;
+    }
+    const portal_creds_candidate_t* candidate = &candidates[candidate_next++];
+
+    wifi_config_t sta_cfg;
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &sta_cfg));
+    strncpy((char*)sta_cfg.sta.ssid, candidate->cred.ssid, sizeof(sta_cfg.sta.ssid));
+    strncpy((char*)sta_cfg.sta.password, candidate->cred.password, sizeof(sta_cfg.sta.password));
+    sta_cfg.sta.bssid_set = true;
+    memcpy(sta_cfg.sta.bssid, candidate->bssid, sizeof(sta_cfg.sta.bssid));
+    sta_cfg.sta.channel = candidate->channel;
+    ESP_LOGI(TAG, "Joining %s (priority %d, rssi %d)", candidate->cred.ssid, candidate->cred.priority,
+             candidate->rssi);
+    connect_with(&sta_cfg, JOIN_CANDIDATE);
+    return true;
+}
+
+static void on_scan_done(void)
+{
+    candidate_count = 0;
+    candidate_next = 0;
+
+    uint16_t count = 0;
+    esp_wifi_scan_get_ap_num(&count);
+    wifi_ap_record_t* records = count > 0 ? malloc(count * sizeof(wifi_ap_record_t)) : NULL;
+    if (records != NULL && esp_wifi_scan_get_ap_records(&count, records) == ESP_OK)
+    {
+        candidate_count = portal_creds_rank(records, count, candidates, CONFIG_ESP_WIFI_PORTAL_CRED_MAX);
+    }
+    free(records);
+    ESP_LOGI(TAG, "%d known network(s) in range", (int)candidate_count);
+
+    if (!join_next_candidate())
+    {
+        // Nothing stored is in range, the configured network may still be hidden
+        join_configured();
+    }
+}
+
+/*
+    Start a join pass: fast join, then the stored networks found by a scan, then the configured network
+*/
+static void join_start(void)
+{
+    join_start_us = esp_timer_get_time();
+    if (!join_fast())
+    {
+        join_scan();
+    }
+}
+
+/*
+    join_start() drives the driver and the join state, which the station events change as well, so it does not run
+    in the esp_timer task
+*/
+static void reconnect_timer_callback(void* arg)
+{
+    if (esp_event_post(PORTAL_JOIN_EVENT, PORTAL_JOIN_EVENT_RECONNECT, NULL, 0, 0) != ESP_OK)
+    {
+        // Event queue full, try again shortly
+        esp_timer_start_once(reconnect_timer, 100 * 1000ULL);
+    }
+}
+
+static void join_event_handler(void* arg, const esp_event_base_t event_base,
+                               const int32_t event_id, void* event_data)
+{
+    // The backoff may have been cancelled since the timer fired, e.g. by the portal starting
+    if (event_id == PORTAL_JOIN_EVENT_RECONNECT && join_method == JOIN_BACKOFF)
+    {
+        join_start();
+    }
+}
+
+static bool has_stored_networks(void)
+{
+    esp_wifi_portal_cred_t cred;
+    size_t count = 0;
+    return esp_wifi_portal_cred_list(&cred, 1, &count) == ESP_OK && count > 0;
+}
+
+/*
+    Decide what to do after a join pass failed. Returns true if the portal should start.
+*/
+static bool on_pass_failed(const uint8_t reason)
+{
+    const reason_class_t reason_class = classify_reason(reason);
+    if (!has_stored_networks())
+    {
+        ESP_LOGI(TAG, "Reconnect policy: no stored networks, starting the portal");
+        join_method = JOIN_NONE;
+        return true;
+    }
+
+    const int64_t now_us = esp_timer_get_time();
+    if (outage_start_us == 0)
+    {
+        outage_start_us = now_us;
+    }
+    failed_attempts++;
+    auth_failures = reason_class == REASON_CREDENTIALS ? auth_failures + 1 : 0;
+    const int64_t outage_ms = (now_us - outage_start_us) / 1000;
+
+    const char* give_up = NULL;
+    if (auth_failures >= CONFIG_ESP_WIFI_PORTAL_RECONNECT_AUTH_FAILURES)
+    {
+        give_up = "credentials rejected";
+    }
+    else if (CONFIG_ESP_WIFI_PORTAL_RECONNECT_MAX_ATTEMPTS > 0 &&
+             failed_attempts >= CONFIG_ESP_WIFI_PORTAL_RECONNECT_MAX_ATTEMPTS)
+    {
+        give_up = "attempts exhausted";
+    }
+    else if (CONFIG_ESP_WIFI_PORTAL_RECONNECT_WINDOW_SEC > 0 &&
+             outage_ms >= CONFIG_ESP_WIFI_PORTAL_RECONNECT_WINDOW_SEC * 1000LL)
+    {
+        give_up = "window expired";
+    }
+
+    if (give_up != NULL)
+    {
+        ESP_LOGW(TAG, "Reconnect policy: attempt %" PRIu32 " failed, reason %d (%s), %s after %" PRId64
+                 " ms, starting the portal", failed_attempts, reason, reason_class_name(reason_class), give_up,
+                 outage_ms);
+        join_method = JOIN_NONE;
+        return true;
+    }
+
+    const uint32_t delay_ms = backoff_delay_ms(failed_attempts);
+    ESP_LOGI(TAG, "Reconnect policy: attempt %" PRIu32 " failed, reason %d (%s), retrying in %" PRIu32 " ms",
+             failed_attempts, reason, reason_class_name(reason_class), delay_ms);
+    join_method = JOIN_BACKOFF;
+    esp_timer_stop(reconnect_timer);
+    esp_timer_start_once(reconnect_timer, delay_ms * 1000ULL);
+    return false;
+}
+
+esp_err_t portal_join_init(void)
+{
+    if (reconnect_timer != NULL)
+    {
+        return ESP_OK;
+    }
+    esp_err_t err = esp_event_handler_instance_register(PORTAL_JOIN_EVENT, ESP_EVENT_ANY_ID, &join_event_handler,
+                                                        NULL, &join_event_handler_instance);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    const esp_timer_create_args_t timer_args = {
+        .callback = reconnect_timer_callback,
+        .name = "portal_reconnect"
+    };
+    err = esp_timer_create(&timer_args, &reconnect_timer);
+    if (err != ESP_OK)
+    {
+        esp_event_handler_instance_unregister(PORTAL_JOIN_EVENT, ESP_EVENT_ANY_ID, join_event_handler_instance);
+        join_event_handler_instance = NULL;
+    }
+    return err;
+}
+
+void portal_join_deinit(void)
+{
+    if (reconnect_timer != NULL)
+    {
+        esp_timer_stop(reconnect_timer);
+        esp_timer_delete(reconnect_timer);
+        reconnect_timer = NULL;
+    }
+    if (join_event_handler_instance != NULL)
+    {
+        esp_event_handler_instance_unregister(PORTAL_JOIN_EVENT, ESP_EVENT_ANY_ID, join_event_handler_instance);
+        join_event_handler_instance = NULL;
+    }
+    join_method = JOIN_NONE;
+}
+
+void portal_join_cancel(void)
+{
+    if (reconnect_timer != NULL)
+    {
+        esp_timer_stop(reconnect_timer);
+    }
+    join_method = JOIN_NONE;
+    // The policy just gave up, the first retry from the portal waits a full interval
+    portal_retry_us = esp_timer_get_time();
+}
+
+bool portal_join_portal_retry(wifi_config_t* sta_cfg, uint8_t* channel)
+{
+#if CONFIG_ESP_WIFI_PORTAL_RECONNECT_IN_PORTAL_SEC > 0
+    const int64_t now_us = esp_timer_get_time();
+    if (now_us - portal_retry_us < CONFIG_ESP_WIFI_PORTAL_RECONNECT_IN_PORTAL_SEC * 1000000LL)
+    {
+        return false;
+    }
+    portal_retry_us = now_us;
+
+    // The portal's scan cache is fresh, no scan of our own is needed
+    wifi_ap_record_t* records = malloc(CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN * sizeof(wifi_ap_record_t));
+    if (records == NULL)
+    {
+        return false;
+    }
+    const uint16_t count = scan_cache_get(records, CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN, NULL);
+    // The candidate list is idle while the portal runs
+    candidate_count = portal_creds_rank(records, count, candidates, CONFIG_ESP_WIFI_PORTAL_CRED_MAX);
+    candidate_next = 0;
+    free(records);
+    if (candidate_count == 0)
+    {
+        return false;
+    }
+
+    const portal_creds_candidate_t* candidate = &candidates[0];
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, sta_cfg));
+    strncpy((char*)sta_cfg->sta.ssid, candidate->cred.ssid, sizeof(sta_cfg->sta.ssid));
+    strncpy((char*)sta_cfg->sta.password, candidate->cred.password, sizeof(sta_cfg->sta.password));
+    sta_cfg->sta.bssid_set = true;
+    memcpy(sta_cfg->sta.bssid, candidate->bssid, sizeof(sta_cfg->sta.bssid));
+    sta_cfg->sta.channel = candidate->channel;
+    *channel = candidate->channel;
+    ESP_LOGI(TAG, "Retrying %s from the portal (priority %d, rssi %d)", candidate->cred.ssid,
+             candidate->cred.priority, candidate->rssi);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool portal_join_on_event(const esp_event_base_t event_base, const int32_t event_id, void* event_data)
+{
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START)
+    {
+        join_start();
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE)
+    {
+        if (join_method == JOIN_SCAN)
+        {
+            on_scan_done();
+        }
+    }
+    else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED)
+    {
+        const wifi_event_sta_disconnected_t* event = (const wifi_event_sta_disconnected_t*)event_data;
+        switch (join_method)
+        {
+        case JOIN_FAST:
+            // The AP may have moved to another channel or been replaced
+            ESP_LOGI(TAG, "Fast join failed, scanning for known networks");
+            join_scan();
+            break;
+        case JOIN_CANDIDATE:
+            if (!join_next_candidate())
+            {
+                return on_pass_failed(event->reason);
+            }
+            break;
+        case JOIN_CONFIGURED:
+            return on_pass_failed(event->reason);
+        case JOIN_NONE:
+            // Link lost after being connected
+            if (classify_reason(event->reason) == REASON_LOCAL)
+            {
+                ESP_LOGI(TAG, "Reconnect policy: disconnected by the application, not reconnecting");
+            }
+            else
+            {
+                ESP_LOGI(TAG, "Reconnect policy: link lost, reason %d, reconnecting", event->reason);
+                join_start();
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP)
+    {
+        const int64_t now_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Joined %" PRId64 " ms after boot, join took %" PRId64 " ms (%s)", now_us / 1000,
+                 (now_us - join_start_us) / 1000, join_method_name(join_method));
+        join_method = JOIN_NONE;
+        failed_attempts = 0;
+        auth_failures = 0;
+        outage_start_us = 0;
+        portal_join_remember();
+    }
+    return false;
+}
+
+void portal_join_remember(void)
+{
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+    {
+        portal_last_ap_t last_ap = {0};
+        memcpy(last_ap.ssid, ap_info.ssid, sizeof(last_ap.ssid) - 1);
+        memcpy(last_ap.bssid, ap_info.bssid, sizeof(last_ap.bssid));
+        last_ap.channel = ap_info.primary;
+        last_ap.authmode = ap_info.authmode;
+        portal_store_set_last_ap(&last_ap);
+    }
+
+    wifi_config_t sta_cfg;
+    if (esp_wifi_get_config(WIFI_IF_STA, &sta_cfg) == ESP_OK)
+    {
+        char ssid[sizeof(sta_cfg.sta.ssid) + 1] = {0};
+        char password[sizeof(sta_cfg.sta.password) + 1] = {0};
+        memcpy(ssid, sta_cfg.sta.ssid, sizeof(sta_cfg.sta.ssid));
+        memcpy(password, sta_cfg.sta.password, sizeof(sta_cfg.sta.password));
+        portal_creds_on_connected(ssid, password);
+    }
+}
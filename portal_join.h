@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Create the reconnect timer and register the handler it posts the retries to on the default event loop
+ */
+esp_err_t portal_join_init(void);
+
+void portal_join_deinit(void);
+
+/**
+ * @brief Stop joining and cancel a pending reconnect, e.g. because the portal takes over the station
+ */
+void portal_join_cancel(void);
+
+/**
+ * @brief Feed a station WIFI_EVENT / IP_EVENT received while the portal is not running
+ *
+ * On WIFI_EVENT_STA_START the station joins the last AP directly with its BSSID and channel. If that fails, one scan
+ * is matched against the credential store and the known networks in range are tried best first. If none is in
+ * range, the current station config is tried with a full scan, which also covers hidden networks.
+ *
+ * When such a pass fails, or the link is lost, the reconnect policy retries with exponential backoff and jitter. It
+ * gives up once the attempts or the time window are used up, when the credentials are rejected repeatedly, or right
+ * away if no network was ever stored.
+ *
+ * @return true once the reconnect policy gave up, the caller may start the portal
+ */
+bool portal_join_on_event(esp_event_base_t event_base, int32_t event_id, void* event_data);
+
+/**
+ * @brief Pick a stored network to retry while the portal is running
+ *
+ * At most every CONFIG_ESP_WIFI_PORTAL_RECONNECT_IN_PORTAL_SEC, the best stored network in the portal's scan cache
+ * is returned, so a device left in the portal after a long router outage recovers on its own.
+ *
+ * @param[out] sta_cfg Station config to join with
+ * @param[out] channel Channel the network was found on
+ * @return true if a retry is due and a stored network is in range
+ */
+bool portal_join_portal_retry(wifi_config_t* sta_cfg, uint8_t* channel);
+
+/**
+ * @brief Remember the network the station just got an IP on, for the store and the next fast join
+ */
+void portal_join_remember(void);
+
+#ifdef __cplusplus
+}
+#endif
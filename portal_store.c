@@ -0,0 +1,119 @@
+#include "portal_store.h"
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <nvs.h>
+
+#define STORE_NAMESPACE "wifi_portal"
+#define LAST_AP_KEY "last_ap"
+#define CREDS_KEY "creds"
+
+static const char* TAG = "esp_wifi_portal";
+
+esp_err_t portal_store_get_last_ap(portal_last_ap_t* ap)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(STORE_NAMESPACE, NVS_READONLY, &nvs);
+    if (err != ESP_OK)
+    {
+        // The namespace does not exist before the first write
+        return err;
+    }
+    size_t len = sizeof(*ap);
+    err = nvs_get_blob(nvs, LAST_AP_KEY, ap, &len);
+    nvs_close(nvs);
+    if (err == ESP_OK && len != sizeof(*ap))
+    {
+        // Written by an incompatible version
+        err = ESP_ERR_NVS_NOT_FOUND;
+    }
+    return err;
+}
+
+esp_err_t portal_store_set_last_ap(const portal_last_ap_t* ap)
+{
+    portal_last_ap_t stored;
+    if (portal_store_get_last_ap(&stored) == ESP_OK && memcmp(&stored, ap, sizeof(stored)) == 0)
+    {
+        return ESP_OK;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(STORE_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to open NVS, err: %d", err);
+        return err;
+    }
+    err = nvs_set_blob(nvs, LAST_AP_KEY, ap, sizeof(*ap));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to save last AP, err: %d", err);
+    }
+    return err;
+}
+
+esp_err_t portal_store_get_creds(esp_wifi_portal_cred_t* creds, size_t* count)
+{
+    *count = 0;
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(STORE_NAMESPACE, NVS_READONLY, &nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        return ESP_OK;
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    size_t len = CONFIG_ESP_WIFI_PORTAL_CRED_MAX * sizeof(*creds);
+    err = nvs_get_blob(nvs, CREDS_KEY, creds, &len);
+    nvs_close(nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        return ESP_OK;
+    }
+    if (err == ESP_ERR_NVS_INVALID_LENGTH || (err == ESP_OK && len % sizeof(*creds) != 0))
+    {
+        // Written by an incompatible version or with a larger CONFIG_ESP_WIFI_PORTAL_CRED_MAX
+        ESP_LOGW(TAG, "Ignoring incompatible credential store");
+        return ESP_OK;
+    }
+    if (err == ESP_OK)
+    {
+        *count = len / sizeof(*creds);
+    }
+    return err;
+}
+
+esp_err_t portal_store_set_creds(const esp_wifi_portal_cred_t* creds, const size_t count)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(STORE_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to open NVS, err: %d", err);
+        return err;
+    }
+    err = count > 0 ? nvs_set_blob(nvs, CREDS_KEY, creds, count * sizeof(*creds)) : nvs_erase_key(nvs, CREDS_KEY);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+    {
+        err = ESP_OK;
+    }
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to save credentials, err: %d", err);
+    }
+    return err;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+#include "esp_wifi_portal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief The AP the station last got an IP from, used for a targeted join on the next connect
+ */
+typedef struct portal_last_ap {
+    uint8_t ssid[33];       /**<! SSID the hint belongs to */
+    uint8_t bssid[6];       /**<! BSSID of the AP */
+    uint8_t channel;        /**<! Primary channel of the AP */
+    uint8_t authmode;       /**<! wifi_auth_mode_t of the AP */
+} portal_last_ap_t;
+
+/**
+ * @brief Load the last joined AP from NVS
+ *
+ * @param[out] ap Filled with the stored AP
+ * @return ESP_OK if a valid record was found, ESP_ERR_NVS_NOT_FOUND if there is none
+ */
+esp_err_t portal_store_get_last_ap(portal_last_ap_t* ap);
+
+/**
+ * @brief Save the last joined AP to NVS, the flash is only written if the record changed
+ */
+esp_err_t portal_store_set_last_ap(const portal_last_ap_t* ap);
+
+/**
+ * @brief Load the credential store
+ *
+ * @param[out] creds Room for CONFIG_ESP_WIFI_PORTAL_CRED_MAX entries
+ * @param[out] count Number of entries loaded, 0 if the store is empty
+ */
+esp_err_t portal_store_get_creds(esp_wifi_portal_cred_t* creds, size_t* count);
+
+/**
+ * @brief Replace the credential store
+ */
+esp_err_t portal_store_set_creds(const esp_wifi_portal_cred_t* creds, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,331 @@
+#include "scan_cache.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+static const char* TAG = "esp_wifi_portal";
+
+// Created on the first start and never deleted, so a scan done event racing scan_cache_stop() always finds it
+static SemaphoreHandle_t cache_lock = NULL;
+
+// Records served to readers, NULL while the cache is stopped. Both buffers are protected by cache_lock.
+static wifi_ap_record_t* cache_records = NULL;
+// Records being filled by the scan done handler
+static wifi_ap_record_t* staging_records = NULL;
+
+static scan_cache_info_t cache_info = {0};
+
+static esp_timer_handle_t scan_timer = NULL;
+
+/**
+ * @brief Map an RSSI to the usual four signal bars
+ *
+ * Records are compared at this granularity so RSSI jitter between two scans does not invalidate the cache.
+ */
+static int rssi_level(const int8_t rssi)
+{
+    if (rssi >= -55) return 4;
+    if (rssi >= -66) return 3;
+    if (rssi >= -77) return 2;
+    if (rssi >= -88) return 1;
+    return 0;
+}
+
+static bool records_equal(const wifi_ap_record_t* a, const wifi_ap_record_t* b, const uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (memcmp(a[i].ssid, b[i].ssid, sizeof(a[i].ssid)) != 0 ||
+            memcmp(a[i].bssid, b[i].bssid, sizeof(a[i].bssid)) != 0 ||
+            a[i].primary != b[i].primary ||
+            a[i].authmode != b[i].authmode ||
+            rssi_level(a[i].rssi) != rssi_level(b[i].rssi))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Drop hidden networks, keep only the strongest record of every SSID and sort by RSSI
+ *
+ * @return Number of records left
+ */
+static uint16_t compact_records(wifi_ap_record_t* records, const uint16_t count)
+{
+    uint16_t kept = 0;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (records[i].ssid[0] == '\0')
+        {
+            continue;
+        }
+
+        uint16_t pos = 0;
+        while (pos < kept && strcmp((const char*)records[pos].ssid, (const char*)records[i].ssid) != 0)
+        {
+            pos++;
+        }
+        if (pos < kept)
+        {
+            if (records[i].rssi <= records[pos].rssi)
+            {
+                continue;
+            }
+            // Stronger duplicate, take its place and let it bubble up below
+            records[pos] = records[i];
+        }
+        else
+        {
+            records[kept] = records[i];
+            pos = kept++;
+        }
+
+        // Insertion sort, the list is short and nearly sorted already
+        while (pos > 0 && records[pos - 1].rssi < records[pos].rssi)
+        {
+            const wifi_ap_record_t tmp = records[pos - 1];
+            records[pos - 1] = records[pos];
+            records[pos] = tmp;
+            pos--;
+        }
+    }
+    return kept;
+}
+
+static void scan_timer_callback(void* arg)
+{
+    scan_cache_request();
+}
+
+esp_err_t scan_cache_request(void)
+{
+    if (cache_lock == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    if (cache_records == NULL)
+    {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    else if (cache_info.scanning)
+    {
+        cache_info.scans_joined++;
+    }
+    else
+    {
+        err = esp_wifi_scan_start(NULL, false);
+        if (err == ESP_OK)
+        {
+            cache_info.scanning = true;
+            cache_info.scans_started++;
+        }
+        else
+        {
+            // Typically the STA is busy connecting, the next timer tick will retry
+            ESP_LOGD(TAG, "Failed to start scan, err: %d", err);
+        }
+    }
+    xSemaphoreGive(cache_lock);
+    return err;
+}
+
+void scan_cache_on_scan_done(const wifi_event_sta_scan_done_t* event)
+{
+    if (cache_lock == NULL)
+    {
+        return;
+    }
+
+    // The buffers are filled and swapped under the lock, scan_cache_stop() may free them from another task
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    if (cache_records == NULL)
+    {
+        xSemaphoreGive(cache_lock);
+        return;
+    }
+
+    uint16_t count = 0;
+    if (event->status == 0)
+    {
+        count = CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN;
+        if (esp_wifi_scan_get_ap_records(&count, staging_records) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to get AP records");
+            count = 0;
+        }
+    }
+    else
+    {
+        esp_wifi_clear_ap_list();
+    }
+
+    const uint16_t kept = compact_records(staging_records, count);
+
+    cache_info.scanning = false;
+    if (event->status == 0)
+    {
+        if (cache_info.updated_us == 0 || kept != cache_info.count ||
+            !records_equal(staging_records, cache_records, kept))
+        {
+            cache_info.generation++;
+        }
+        wifi_ap_record_t* tmp = cache_records;
+        cache_records = staging_records;
+        staging_records = tmp;
+        cache_info.count = kept;
+        cache_info.updated_us = esp_timer_get_time();
+    }
+    const uint32_t generation = cache_info.generation;
+    xSemaphoreGive(cache_lock);
+
+    ESP_LOGD(TAG, "Scan done, status: %" PRIu32 ", %u APs cached, generation %" PRIu32,
+             event->status, kept, generation);
+}
+
+void scan_cache_get_info(scan_cache_info_t* info)
+{
+    if (cache_lock == NULL)
+    {
+        memset(info, 0, sizeof(*info));
+        return;
+    }
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    *info = cache_info;
+    xSemaphoreGive(cache_lock);
+}
+
+uint16_t scan_cache_get(wifi_ap_record_t* records, const uint16_t max, scan_cache_info_t* info)
+{
+    if (cache_lock == NULL)
+    {
+        if (info) { memset(info, 0, sizeof(*info)); }
+        return 0;
+    }
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    const uint16_t count = cache_info.count < max ? cache_info.count : max;
+    memcpy(records, cache_records, count * sizeof(wifi_ap_record_t));
+    if (info) { *info = cache_info; }
+    xSemaphoreGive(cache_lock);
+    return count;
+}
+
+bool scan_cache_find(const char* ssid, wifi_ap_record_t* record)
+{
+    if (cache_lock == NULL)
+    {
+        return false;
+    }
+    bool found = false;
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    for (uint16_t i = 0; i < cache_info.count; i++)
+    {
+        if (strcmp((const char*)cache_records[i].ssid, ssid) == 0)
+        {
+            *record = cache_records[i];
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(cache_lock);
+    return found;
+}
+
+esp_err_t scan_cache_start(void)
+{
+    if (cache_lock == NULL)
+    {
+        cache_lock = xSemaphoreCreateMutex();
+        if (cache_lock == NULL)
+        {
+            ESP_LOGE(TAG, "Memory allocation for scan cache failed!");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    if (cache_records != NULL)
+    {
+        ESP_LOGE(TAG, "Scan cache is already started");
+        return ESP_FAIL;
+    }
+
+    wifi_ap_record_t* records = calloc(CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN, sizeof(wifi_ap_record_t));
+    wifi_ap_record_t* staging = calloc(CONFIG_ESP_WIFI_PORTAL_MAX_SCAN_CONN, sizeof(wifi_ap_record_t));
+    if (!records || !staging)
+    {
+        ESP_LOGE(TAG, "Memory allocation for scan cache failed!");
+        free(records);
+        free(staging);
+        return ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    cache_records = records;
+    staging_records = staging;
+    memset(&cache_info, 0, sizeof(cache_info));
+    xSemaphoreGive(cache_lock);
+
+    if (CONFIG_ESP_WIFI_PORTAL_SCAN_INTERVAL_SEC > 0)
+    {
+        const esp_timer_create_args_t timer_args = {
+            .callback = scan_timer_callback,
+            .name = "portal_scan"
+        };
+        esp_err_t err = esp_timer_create(&timer_args, &scan_timer);
+        if (err == ESP_OK)
+        {
+            err = esp_timer_start_periodic(scan_timer, CONFIG_ESP_WIFI_PORTAL_SCAN_INTERVAL_SEC * 1000000ULL);
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to start scan timer, err: %d", err);
+            scan_cache_stop();
+            return err;
+        }
+    }
+
+    // Fill the cache right away so the first page load has something to show
+    scan_cache_request();
+    return ESP_OK;
+}
+
+void scan_cache_stop(void)
+{
+    if (scan_timer != NULL)
+    {
+        esp_timer_stop(scan_timer);
+        esp_timer_delete(scan_timer);
+        scan_timer = NULL;
+    }
+    if (cache_lock == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(cache_lock, portMAX_DELAY);
+    if (cache_records != NULL)
+    {
+        ESP_LOGI(TAG, "Scan cache: %" PRIu32 " scans started, %" PRIu32 " requests coalesced",
+                 cache_info.scans_started, cache_info.scans_joined);
+        if (cache_info.scanning)
+        {
+            esp_wifi_scan_stop();
+            esp_wifi_clear_ap_list();
+            cache_info.scanning = false;
+        }
+    }
+    free(cache_records);
+    cache_records = NULL;
+    free(staging_records);
+    staging_records = NULL;
+    // Readers see an empty cache from now on
+    memset(&cache_info, 0, sizeof(cache_info));
+    xSemaphoreGive(cache_lock);
+}
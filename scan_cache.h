@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Metadata describing the current content of the scan cache
+ */
+typedef struct scan_cache_info {
+    uint32_t generation;    /**<! Bumped whenever a completed scan changes the cached records, 0 until the first scan */
+    int64_t updated_us;     /**<! esp_timer time of the last completed scan, 0 if no scan completed yet */
+    bool scanning;          /**<! True while a scan is in flight */
+    uint16_t count;         /**<! Number of cached records */
+    uint32_t scans_started; /**<! Number of radio scans started by the cache */
+    uint32_t scans_joined;  /**<! Number of scan requests coalesced into a scan already in flight */
+} scan_cache_info_t;
+
+/**
+ * @brief Start the background scanner
+ *
+ * Allocates the record buffers, kicks off a first scan and arms the periodic scan timer
+ * (CONFIG_ESP_WIFI_PORTAL_SCAN_INTERVAL_SEC).
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t scan_cache_start(void);
+
+/**
+ * @brief Stop the background scanner and release the cache
+ */
+void scan_cache_stop(void);
+
+/**
+ * @brief Request an on-demand scan
+ *
+ * Scans are single-flight: if a scan is already in flight the request joins it instead of starting another one,
+ * and the caller gets that scan's results once WIFI_EVENT_SCAN_DONE is handled.
+ *
+ * @return ESP_OK if a scan is running after the call
+ */
+esp_err_t scan_cache_request(void);
+
+/**
+ * @brief Feed a WIFI_EVENT_SCAN_DONE event into the cache
+ *
+ * @param event Event data of WIFI_EVENT_SCAN_DONE
+ */
+void scan_cache_on_scan_done(const wifi_event_sta_scan_done_t* event);
+
+/**
+ * @brief Get the cache metadata
+ *
+ * @param[out] info Filled with the current metadata
+ */
+void scan_cache_get_info(scan_cache_info_t* info);
+
+/**
+ * @brief Copy the cached records
+ *
+ * Records are unique by SSID (the strongest BSS is kept), hidden networks are left out and the list is sorted by
+ * descending RSSI.
+ *
+ * @param[out] records Buffer for at least `max` records
+ * @param max Capacity of `records`
+ * @param[out] info Optional, filled with the metadata matching the copied records
+ * @return Number of records copied
+ */
+uint16_t scan_cache_get(wifi_ap_record_t* records, uint16_t max, scan_cache_info_t* info);
+
+/**
+ * @brief Look up a network in the cache
+ *
+ * @param ssid SSID to look for
+ * @param[out] record Filled with the strongest BSS of the network
+ * @return true if the network is in the cache
+ */
+bool scan_cache_find(const char* ssid, wifi_ap_record_t* record);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,88 @@
+/*
+    malloc() and friends wrapped with `-Wl,--wrap=`, see ALLOC_WRAP in the Makefile
+*/
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "host_test.h"
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+static size_t calls;
+static size_t in_use;
+static size_t peak;
+
+static void count_alloc(void* ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+    const size_t now = __atomic_add_fetch(&in_use, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    size_t max = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while (now > max && !__atomic_compare_exchange_n(&peak, &max, now, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+static void count_free(void* ptr)
+{
+    if (ptr != NULL)
+    {
+        __atomic_sub_fetch(&in_use, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    }
+}
+
+void* __wrap_malloc(const size_t size)
+{
+    void* ptr = __real_malloc(size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void* __wrap_calloc(const size_t count, const size_t size)
+{
+    void* ptr = __real_calloc(count, size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void* __wrap_realloc(void* ptr, const size_t size)
+{
+    count_free(ptr);
+    void* new_ptr = __real_realloc(ptr, size);
+    // A failed realloc() keeps the old block
+    count_alloc(new_ptr != NULL || size == 0 ? new_ptr : ptr);
+    return new_ptr;
+}
+
+void __wrap_free(void* ptr)
+{
+    count_free(ptr);
+    __real_free(ptr);
+}
+
+size_t alloc_count_calls(void)
+{
+    return __atomic_load_n(&calls, __ATOMIC_RELAXED);
+}
+
+size_t alloc_count_in_use(void)
+{
+    return __atomic_load_n(&in_use, __ATOMIC_RELAXED);
+}
+
+size_t alloc_count_peak(void)
+{
+    return __atomic_load_n(&peak, __ATOMIC_RELAXED);
+}
+
+void alloc_count_reset_peak(void)
+{
+    __atomic_store_n(&peak, alloc_count_in_use(), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,117 @@
+/*
+    Replay of the DNS traffic of several clients joining at once: each sends bursts of queries back to back, the way
+    a phone fires A, AAAA and HTTPS lookups for its probes in parallel, and then collects the replies. Every query
+    must be answered; reports the throughput and the batches the server drained them in.
+*/
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "dns_server.h"
+#include "dns_query.h"
+#include "host_test.h"
+
+#define CLIENTS 5
+#define BURSTS 2000
+#define BURST_LEN 8
+
+static const char* names[] = {
+    "connectivitycheck.gstatic.com", "captive.apple.com", "www.msftconnecttest.com", "clients3.google.com",
+};
+static const uint16_t types[] = {DNS_QUERY_TYPE_A, DNS_QUERY_TYPE_AAAA, DNS_QUERY_TYPE_HTTPS};
+
+typedef struct
+{
+    int index;
+    int answered;
+    int lost;
+} client_t;
+
+static void* client_main(void* arg)
+{
+    client_t* client = arg;
+    const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(sock >= 0);
+    const struct timeval timeout = {.tv_sec = 1};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    const struct sockaddr_in server = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    uint8_t packet[512];
+    for (int burst = 0; burst < BURSTS; burst++)
+    {
+        uint16_t first_id = (uint16_t)(client->index << 12 | (burst * BURST_LEN & 0x0FFF));
+        for (int i = 0; i < BURST_LEN; i++)
+        {
+            const int q = burst * BURST_LEN + i;
+            const size_t len = dns_query_build(packet, sizeof(packet), (uint16_t)(first_id + i),
+                                               names[q % 4], types[q % 3], q % 2 == 0);
+            CHECK(sendto(sock, packet, len, 0, (const struct sockaddr*)&server, sizeof(server)) == (ssize_t)len);
+        }
+        // Replies come back in order, the server answers a batch in the order it was received
+        for (int i = 0; i < BURST_LEN; i++)
+        {
+            const ssize_t len = recv(sock, packet, sizeof(packet), 0);
+            if (len < 0)
+            {
+                client->lost += BURST_LEN - i;
+                break;
+            }
+            CHECK(dns_reply_answers(packet, len, (uint16_t)(first_id + i)) >= 0);
+            client->answered++;
+        }
+    }
+    close(sock);
+    return NULL;
+}
+
+int main(void)
+{
+    dns_server_config_t config = DNS_SERVER_CONFIG_SINGLE("*", NULL);
+    config.item[0].ip.addr = ESP_IP4TOADDR(192, 168, 4, 1);
+    dns_server_handle_t handle = start_dns_server(&config);
+    CHECK(handle != NULL);
+    // Let the task bind its socket
+    usleep(100 * 1000);
+
+    pthread_t threads[CLIENTS];
+    client_t clients[CLIENTS] = {0};
+    const int64_t start = esp_timer_get_time();
+    for (int i = 0; i < CLIENTS; i++)
+    {
+        clients[i].index = i;
+        CHECK(pthread_create(&threads[i], NULL, client_main, &clients[i]) == 0);
+    }
+    int answered = 0;
+    int lost = 0;
+    for (int i = 0; i < CLIENTS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        answered += clients[i].answered;
+        lost += clients[i].lost;
+    }
+    const int64_t elapsed = esp_timer_get_time() - start;
+
+    dns_server_stats_t stats;
+    dns_server_get_stats(handle, &stats);
+    stop_dns_server(handle);
+
+    printf("%d clients x %d bursts of %d: %d answered, %d lost, %.0f queries/s\n", CLIENTS, BURSTS, BURST_LEN,
+           answered, lost, answered * 1e6 / (double)elapsed);
+    printf("server: %" PRIu32 " queries, %" PRIu32 " answered, %" PRIu32 " malformed, %" PRIu32 " wakeups, "
+           "%.2f datagrams per wakeup\n", stats.queries, stats.answered, stats.malformed, stats.batches,
+           stats.batches ? (double)stats.queries / stats.batches : 0.0);
+    CHECK(lost == 0);
+    CHECK(stats.answered == CLIENTS * BURSTS * BURST_LEN);
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+    Start and stop the DNS server over and over, as the portal does on every provisioning round. Each cycle has the
+    server answer a query first, so stop always finds the task inside its loop. Reports the start and stop latency,
+    and checks heap, open descriptors and the port are back where they were.
+*/
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "dns_server.h"
+#include "dns_query.h"
+#include "host_test.h"
+
+#define CYCLES 1000
+
+static int open_fds(void)
+{
+    int count = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    CHECK(dir != NULL);
+    while (readdir(dir) != NULL)
+    {
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/*
+    Send one query and wait for its reply, retrying while the task is still binding its socket
+*/
+static void query_once(const int sock, const uint16_t id)
+{
+    const struct sockaddr_in server = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    uint8_t packet[512];
+    const size_t len = dns_query_build(packet, sizeof(packet), id, "captive.apple.com", DNS_QUERY_TYPE_A, false);
+    for (int attempt = 0; attempt < 500; attempt++)
+    {
+        CHECK(sendto(sock, packet, len, 0, (const struct sockaddr*)&server, sizeof(server)) == (ssize_t)len);
+        uint8_t reply[512];
+        const ssize_t reply_len = recv(sock, reply, sizeof(reply), 0);
+        if (reply_len > 0 && dns_reply_answers(reply, reply_len, id) == 1)
+        {
+            return;
+        }
+    }
+    CHECK(!"no reply from the DNS server");
+}
+
+static bool port_free(void)
+{
+    const int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+    const struct sockaddr_in6 addr = {.sin6_family = AF_INET6, .sin6_port = htons(DNS_PORT)};
+    const bool free = bind(sock, (const struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(sock);
+    return free;
+}
+
+int main(void)
+{
+    dns_server_config_t config = DNS_SERVER_CONFIG_SINGLE("*", NULL);
+    config.item[0].ip.addr = ESP_IP4TOADDR(192, 168, 4, 1);
+
+    const int client = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(client >= 0);
+    const struct timeval timeout = {.tv_usec = 2 * 1000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    const int fds_before = open_fds();
+    const size_t heap_before = alloc_count_in_use();
+    int64_t start_sum = 0;
+    int64_t start_max = 0;
+    int64_t stop_sum = 0;
+    int64_t stop_max = 0;
+    size_t heap_at_10 = 0;
+
+    for (int i = 0; i < CYCLES; i++)
+    {
+        int64_t t = esp_timer_get_time();
+        dns_server_handle_t handle = start_dns_server(&config);
+        const int64_t start_us = esp_timer_get_time() - t;
+        CHECK(handle != NULL);
+
+        query_once(client, (uint16_t)i);
+
+        t = esp_timer_get_time();
+        stop_dns_server(handle);
+        const int64_t stop_us = esp_timer_get_time() - t;
+
+        start_sum += start_us;
+        stop_sum += stop_us;
+        start_max = start_us > start_max ? start_us : start_max;
+        stop_max = stop_us > stop_max ? stop_us : stop_max;
+        if (i == 9)
+        {
+            heap_at_10 = alloc_count_in_use();
+        }
+    }
+    // The last task may still be on its way out of vTaskDelete()
+    usleep(10 * 1000);
+
+    const int fds_after = open_fds();
+    const size_t heap_after = alloc_count_in_use();
+    printf("%d cycles: start avg %.1f us max %" PRId64 " us, stop avg %.1f us max %" PRId64 " us\n", CYCLES,
+           (double)start_sum / CYCLES, start_max, (double)stop_sum / CYCLES, stop_max);
+    printf("open fds %d -> %d, heap in use %zu -> %zu (after 10 cycles %zu, peak %zu), port %d %s\n", fds_before,
+           fds_after, heap_before, heap_after, heap_at_10, alloc_count_peak(), DNS_PORT,
+           port_free() ? "free" : "still bound");
+    CHECK(fds_after == fds_before);
+    CHECK(heap_after == heap_before);
+    CHECK(port_free());
+    close(client);
+    return 0;
+}
@@ -0,0 +1,221 @@
+/*
+    /scan serialization: json_stream against the cJSON tree the handler used to build, on the same records.
+    Checks the escaping and that the stream never touches the heap, then reports time and heap peak per document.
+    The cJSON side is built when CJSON_DIR (by default from IDF_PATH) has cJSON.c.
+*/
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "json_stream.h"
+#include "host_test.h"
+
+#ifdef HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+#define AP_COUNT 40
+#define ROUNDS 20000
+
+typedef struct
+{
+    char data[8192];
+    size_t len;
+    int flushes;
+} sink_t;
+
+static esp_err_t sink_flush(void* ctx, const char* data, const size_t len)
+{
+    sink_t* sink = ctx;
+    if (sink->len + len > sizeof(sink->data))
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(sink->data + sink->len, data, len);
+    sink->len += len;
+    sink->flushes++;
+    return ESP_OK;
+}
+
+static const char* stream_string(const char* str, const size_t max_len)
+{
+    static sink_t sink;
+    json_stream_t js;
+    sink.len = 0;
+    json_stream_init(&js, sink_flush, &sink);
+    json_stream_strn(&js, str, max_len);
+    CHECK(json_stream_finish(&js) == ESP_OK);
+    sink.data[sink.len] = '\0';
+    return sink.data;
+}
+
+static void test_escaping(void)
+{
+    CHECK(strcmp(stream_string("plain", SIZE_MAX), "\"plain\"") == 0);
+    CHECK(strcmp(stream_string("a\"b\\c", SIZE_MAX), "\"a\\\"b\\\\c\"") == 0);
+    CHECK(strcmp(stream_string("</script>", SIZE_MAX), "\"\\u003c/script>\"") == 0);
+    CHECK(strcmp(stream_string("\t\x7f", SIZE_MAX), "\"\\u0009\\u007f\"") == 0);
+    // Valid UTF-8 is kept, stray bytes are taken as Latin-1
+    CHECK(strcmp(stream_string("caf\xc3\xa9", SIZE_MAX), "\"caf\xc3\xa9\"") == 0);
+    CHECK(strcmp(stream_string("caf\xe9", SIZE_MAX), "\"caf\\u00e9\"") == 0);
+    CHECK(strcmp(stream_string("\xed\xa0\x80", SIZE_MAX), "\"\\u00ed\\u00a0\\u0080\"") == 0);
+    CHECK(strcmp(stream_string("\xc3", SIZE_MAX), "\"\\u00c3\"") == 0);
+    // An SSID field is not NUL terminated when it has all 32 bytes
+    CHECK(strcmp(stream_string("0123456789abcdef0123456789abcdefXX", 32),
+                 "\"0123456789abcdef0123456789abcdef\"") == 0);
+}
+
+static void make_records(wifi_ap_record_t* records)
+{
+    static const char* names[] = {"HomeNet", "Caf\xc3\xa9 \"Free\"", "guest<5G>", "DIRECT-\xe9\xe8", "office\\lab"};
+    for (int i = 0; i < AP_COUNT; i++)
+    {
+        wifi_ap_record_t* ap = &records[i];
+        memset(ap, 0, sizeof(*ap));
+        if (i % 8 == 7)
+        {
+            // Longest SSID, no terminating NUL in the record
+            memset(ap->ssid, 'x', 32);
+        }
+        else
+        {
+            snprintf((char*)ap->ssid, sizeof(ap->ssid), "%s-%02d", names[i % 5], i);
+        }
+        ap->rssi = (int8_t)(-30 - i);
+        ap->primary = 1 + i % 13;
+        ap->authmode = (wifi_auth_mode_t)(i % 8);
+        for (int b = 0; b < 6; b++)
+        {
+            ap->bssid[b] = (uint8_t)(i * 7 + b);
+        }
+    }
+}
+
+static void format_bssid(char* out, const uint8_t* bssid)
+{
+    sprintf(out, "%02x:%02x:%02x:%02x:%02x:%02x", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+}
+
+/*
+    The aps array as the /scan handler writes it, see write_scan_json() in http_server.c
+*/
+static size_t write_stream(const wifi_ap_record_t* records, sink_t* sink)
+{
+    json_stream_t js;
+    char bssid[18];
+    sink->len = 0;
+    sink->flushes = 0;
+    json_stream_init(&js, sink_flush, sink);
+    json_stream_raw(&js, "[", 1);
+    for (int i = 0; i < AP_COUNT; i++)
+    {
+        const wifi_ap_record_t* ap = &records[i];
+        if (i > 0)
+        {
+            json_stream_raw(&js, ",", 1);
+        }
+        json_stream_raw(&js, "{", 1);
+        json_stream_key(&js, "ssid");
+        json_stream_strn(&js, (const char*)ap->ssid, sizeof(ap->ssid));
+        json_stream_raw(&js, ",", 1);
+        json_stream_key(&js, "rssi");
+        json_stream_int(&js, ap->rssi);
+        json_stream_raw(&js, ",", 1);
+        json_stream_key(&js, "channel");
+        json_stream_int(&js, ap->primary);
+        json_stream_raw(&js, ",", 1);
+        json_stream_key(&js, "auth");
+        json_stream_int(&js, ap->authmode);
+        json_stream_raw(&js, ",", 1);
+        json_stream_key(&js, "bssid");
+        format_bssid(bssid, ap->bssid);
+        json_stream_str(&js, bssid);
+        json_stream_raw(&js, "}", 1);
+    }
+    json_stream_raw(&js, "]", 1);
+    CHECK(json_stream_finish(&js) == ESP_OK);
+    return sink->len;
+}
+
+#ifdef HAVE_CJSON
+/*
+    The same document the way the handler used to build it: a tree with a node per value, printed to a heap string
+*/
+static size_t write_cjson(const wifi_ap_record_t* records)
+{
+    char ssid[33];
+    char bssid[18];
+    cJSON* root = cJSON_CreateArray();
+    CHECK(root != NULL);
+    for (int i = 0; i < AP_COUNT; i++)
+    {
+        const wifi_ap_record_t* ap = &records[i];
+        cJSON* item = cJSON_CreateObject();
+        CHECK(item != NULL);
+        memcpy(ssid, ap->ssid, 32);
+        ssid[32] = '\0';
+        cJSON_AddStringToObject(item, "ssid", ssid);
+        cJSON_AddNumberToObject(item, "rssi", ap->rssi);
+        cJSON_AddNumberToObject(item, "channel", ap->primary);
+        cJSON_AddNumberToObject(item, "auth", ap->authmode);
+        format_bssid(bssid, ap->bssid);
+        cJSON_AddStringToObject(item, "bssid", bssid);
+        cJSON_AddItemToArray(root, item);
+    }
+    char* json = cJSON_PrintUnformatted(root);
+    CHECK(json != NULL);
+    const size_t len = strlen(json);
+    cJSON_Delete(root);
+    free(json);
+    return len;
+}
+#endif
+
+int main(void)
+{
+    static wifi_ap_record_t records[AP_COUNT];
+    static sink_t sink;
+
+    test_escaping();
+    make_records(records);
+
+    size_t calls = alloc_count_calls();
+    alloc_count_reset_peak();
+    size_t peak_base = alloc_count_in_use();
+    const size_t stream_len = write_stream(records, &sink);
+    CHECK(alloc_count_calls() == calls);
+    CHECK(sink.data[0] == '[' && sink.data[stream_len - 1] == ']');
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        write_stream(records, &sink);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    printf("json_stream: %d APs, %zu bytes in %d flushes, %.2f us per document, heap peak %zu bytes, %zu allocations\n",
+           AP_COUNT, stream_len, sink.flushes, (double)elapsed / ROUNDS, alloc_count_peak() - peak_base,
+           alloc_count_calls() - calls);
+
+#ifdef HAVE_CJSON
+    calls = alloc_count_calls();
+    alloc_count_reset_peak();
+    peak_base = alloc_count_in_use();
+    const size_t cjson_len = write_cjson(records);
+    const size_t cjson_calls = alloc_count_calls() - calls;
+    const size_t cjson_peak = alloc_count_peak() - peak_base;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        write_cjson(records);
+    }
+    elapsed = esp_timer_get_time() - start;
+    printf("cJSON:       %d APs, %zu bytes, %.2f us per document, heap peak %zu bytes, %zu allocations\n",
+           AP_COUNT, cjson_len, (double)elapsed / ROUNDS, cjson_peak, cjson_calls);
+#else
+    printf("cJSON:       skipped, set IDF_PATH or CJSON_DIR to compare\n");
+#endif
+    return 0;
+}
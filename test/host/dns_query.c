@@ -0,0 +1,57 @@
+#include "dns_query.h"
+
+#include <string.h>
+
+static void put16(uint8_t* p, const uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value & 0xFF;
+}
+
+size_t dns_query_build(uint8_t* buf, const size_t max_len, const uint16_t id, const char* name, const uint16_t type,
+                       const bool edns)
+{
+    const size_t name_len = strlen(name);
+    const size_t len = 12 + name_len + 2 + 4 + (edns ? 11 : 0);
+    if (len > max_len)
+    {
+        return 0;
+    }
+    memset(buf, 0, len);
+    put16(buf, id);
+    put16(buf + 2, 0x0100);     // RD
+    put16(buf + 4, 1);
+    put16(buf + 10, edns ? 1 : 0);
+
+    // Labels, each length takes the place of the dot before it
+    uint8_t* label = buf + 12;
+    memcpy(label + 1, name, name_len);
+    for (size_t i = 0; i <= name_len; i++)
+    {
+        if (i == name_len || name[i] == '.')
+        {
+            *label = (uint8_t)(buf + 12 + i - label);
+            label = buf + 12 + i + 1;
+        }
+    }
+    uint8_t* p = buf + 12 + name_len + 2;
+    put16(p, type);
+    put16(p + 2, 1);
+    if (edns)
+    {
+        // Root name, OPT, 1232 byte UDP payload
+        p += 4;
+        put16(p + 1, 41);
+        put16(p + 3, 1232);
+    }
+    return len;
+}
+
+int dns_reply_answers(const uint8_t* reply, const size_t len, const uint16_t id)
+{
+    if (len < 12 || (reply[0] << 8 | reply[1]) != id || (reply[2] & 0x80) == 0 || (reply[3] & 0x0F) != 0)
+    {
+        return -1;
+    }
+    return reply[6] << 8 | reply[7];
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_QUERY_TYPE_A 1
+#define DNS_QUERY_TYPE_AAAA 28
+#define DNS_QUERY_TYPE_HTTPS 65
+
+/*
+    Write a standard query for one question as a stub resolver sends it, with RD set and optionally an EDNS OPT
+    record. Returns the length of the packet, 0 if it does not fit.
+*/
+size_t dns_query_build(uint8_t* buf, size_t max_len, uint16_t id, const char* name, uint16_t type, bool edns);
+
+/*
+    Check a reply matches query `id` and has no error code. Returns the number of answers, -1 for a bad reply.
+*/
+int dns_reply_answers(const uint8_t* reply, size_t len, uint16_t id);
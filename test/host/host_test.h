@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(cond) do {                                                                \
+        if (!(cond))                                                                    \
+        {                                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            exit(1);                                                                    \
+        }                                                                               \
+    } while (0)
+
+/*
+    Heap use of everything linked into the program, counted by alloc_count.c. Calls from the C library itself are
+    not seen.
+*/
+size_t alloc_count_calls(void);
+size_t alloc_count_in_use(void);
+size_t alloc_count_peak(void);
+void alloc_count_reset_peak(void);
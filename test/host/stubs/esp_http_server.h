@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "esp_err.h"
+
+#define HTTPD_MAX_URI_LEN 512
+
+#define ESP_ERR_HTTPD_BASE 0xb000
+#define ESP_ERR_HTTPD_RESULT_TRUNC (ESP_ERR_HTTPD_BASE + 6)
+
+/*
+    A request as a handler sees it. `aux` is owned by the test, which implements the functions below on top of it.
+*/
+typedef struct httpd_req
+{
+    const char* uri;
+    void* aux;
+} httpd_req_t;
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* r, const char* field, char* val, size_t val_size);
+int httpd_send(httpd_req_t* r, const char* buf, size_t buf_len);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+
+// Errors and warnings go to stderr, lower levels are compiled out but still type checked
+#define ESP_HOST_LOG(level, tag, format, ...) do {                              \
+        if (level <= CONFIG_LOG_DEFAULT_LEVEL)                                  \
+        {                                                                       \
+            fprintf(stderr, "%s: " format "\n", tag, ##__VA_ARGS__);           \
+        }                                                                       \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_HOST_LOG(1, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_HOST_LOG(2, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_HOST_LOG(3, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_HOST_LOG(4, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_HOST_LOG(5, tag, format, ##__VA_ARGS__)
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_task* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* arg);
+
+// A detached thread, the stack size and priority are ignored
+BaseType_t xTaskCreate(TaskFunction_t task, const char* name, uint32_t stack_size, void* arg, UBaseType_t priority,
+                       TaskHandle_t* handle);
+
+// Only a task deleting itself is supported
+void vTaskDelete(TaskHandle_t task);
+
+void vTaskDelay(TickType_t ticks);
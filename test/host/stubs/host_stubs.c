@@ -0,0 +1,220 @@
+/*
+    Just enough of ESP-IDF, FreeRTOS and lwIP for the host builds of the component's platform independent parts.
+    FreeRTOS tasks and semaphores map onto pthreads, lwIP sockets are the host's.
+*/
+#include <errno.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/sockets.h"
+#include "lwip/udp.h"
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+const esp_event_base_t IP_EVENT = "IP_EVENT";
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t event_base, int32_t event_id,
+                                              esp_event_handler_t event_handler, void* event_handler_arg,
+                                              esp_event_handler_instance_t* instance)
+{
+    static int dummy;
+    *instance = &dummy;
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_unregister(esp_event_base_t event_base, int32_t event_id,
+                                                esp_event_handler_instance_t instance)
+{
+    return ESP_OK;
+}
+
+esp_netif_t* esp_netif_get_handle_from_ifkey(const char* if_key)
+{
+    return NULL;
+}
+
+esp_err_t esp_netif_get_ip_info(esp_netif_t* esp_netif, esp_netif_ip_info_t* ip_info)
+{
+    return ESP_ERR_INVALID_ARG;
+}
+
+int esp_netif_get_all_ip6(esp_netif_t* esp_netif, esp_ip6_addr_t if_ip6[])
+{
+    return 0;
+}
+
+esp_ip6_addr_type_t esp_netif_ip6_get_addr_type(esp_ip6_addr_t* ip6_addr)
+{
+    return ESP_IP6_ADDR_IS_UNKNOWN;
+}
+
+struct host_task
+{
+    TaskFunction_t task;
+    void* arg;
+};
+
+static void* task_main(void* arg)
+{
+    struct host_task task = *(struct host_task*)arg;
+    free(arg);
+    task.task(task.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char* name, uint32_t stack_size, void* arg, UBaseType_t priority,
+                       TaskHandle_t* handle)
+{
+    struct host_task* start = malloc(sizeof(*start));
+    if (start == NULL)
+    {
+        return pdFALSE;
+    }
+    start->task = task;
+    start->arg = arg;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, task_main, start) != 0)
+    {
+        free(start);
+        return pdFALSE;
+    }
+    pthread_detach(thread);
+    if (handle)
+    {
+        // Only good for comparing against NULL
+        *handle = (TaskHandle_t)start;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(const TickType_t ticks)
+{
+    const struct timespec delay = {.tv_sec = ticks / 1000, .tv_nsec = (long)(ticks % 1000) * 1000000};
+    nanosleep(&delay, NULL);
+}
+
+struct host_semaphore
+{
+    sem_t sem;
+};
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    SemaphoreHandle_t sem = malloc(sizeof(*sem));
+    if (sem != NULL && sem_init(&sem->sem, 0, 0) != 0)
+    {
+        free(sem);
+        return NULL;
+    }
+    return sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, const TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        return sem_wait(&sem->sem) == 0 ? pdTRUE : pdFALSE;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticks / 1000;
+    deadline.tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    int ret;
+    while ((ret = sem_timedwait(&sem->sem, &deadline)) != 0 && errno == EINTR)
+    {
+    }
+    return ret == 0 ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    // A binary semaphore, giving it twice keeps it at one
+    int value;
+    sem_getvalue(&sem->sem, &value);
+    return value == 0 && sem_post(&sem->sem) == 0 ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    sem_destroy(&sem->sem);
+    free(sem);
+}
+
+#undef socket
+
+int lwip_socket(const int domain, const int type, const int protocol)
+{
+    return socket(domain, type, protocol == IPPROTO_IP || protocol == IPPROTO_IPV6 ? 0 : protocol);
+}
+
+const ip_addr_t ip_addr_any_type = {.type = IPADDR_TYPE_ANY};
+
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data* call)
+{
+    return ERR_IF;
+}
+
+struct pbuf* pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+    return NULL;
+}
+
+uint8_t pbuf_free(struct pbuf* p)
+{
+    return 0;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf* p, void* dataptr, u16_t len, u16_t offset)
+{
+    return 0;
+}
+
+err_t pbuf_take(struct pbuf* p, const void* dataptr, u16_t len)
+{
+    return ERR_MEM;
+}
+
+struct udp_pcb* udp_new_ip_type(uint8_t type)
+{
+    return NULL;
+}
+
+err_t udp_bind(struct udp_pcb* pcb, const ip_addr_t* ipaddr, u16_t port)
+{
+    return ERR_IF;
+}
+
+void udp_recv(struct udp_pcb* pcb, udp_recv_fn recv, void* recv_arg)
+{
+}
+
+err_t udp_sendto(struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* dst_ip, u16_t dst_port)
+{
+    return ERR_IF;
+}
+
+void udp_remove(struct udp_pcb* pcb)
+{
+}
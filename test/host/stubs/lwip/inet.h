@@ -0,0 +1,9 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define IPADDR_ANY ((uint32_t)0x00000000UL)
+
+#define inet_ntoa_r(addr, buf, buflen) inet_ntop(AF_INET, &(addr), (buf), (buflen))
+#define inet6_ntoa_r(addr, buf, buflen) inet_ntop(AF_INET6, &(addr), (buf), (buflen))
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "sdkconfig.h"
+
+#define LWIP_IPV4 1
+#define LWIP_IPV6 CONFIG_LWIP_IPV6
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "lwip/err.h"
+
+struct tcpip_api_call_data
+{
+    int unused;
+};
+
+typedef err_t (*tcpip_api_call_fn)(struct tcpip_api_call_data* call);
+
+// Returns ERR_IF, there is no tcpip thread to run `fn` in
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data* call);
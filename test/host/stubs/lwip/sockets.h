@@ -0,0 +1,19 @@
+#pragma once
+
+// lwIP's BSD socket API is the host's
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "lwip/inet.h"
+#include "lwip/opt.h"
+
+/*
+    lwIP takes the IP level of a socket as its protocol, e.g. IPPROTO_IPV6 for a UDP socket over IPv6, the host only
+    the protocol of its type or 0
+*/
+int lwip_socket(int domain, int type, int protocol);
+#define socket(domain, type, protocol) lwip_socket(domain, type, protocol)
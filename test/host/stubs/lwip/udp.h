@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "lwip/err.h"
+#include "lwip/opt.h"
+
+/*
+    Raw API of the `in_tcpip_task` mode. The host has no tcpip thread, tcpip_api_call() fails and nothing here is
+    reached, it only has to link.
+*/
+typedef uint16_t u16_t;
+
+typedef struct
+{
+    union
+    {
+        struct { uint32_t addr[4]; uint8_t zone; } ip6;
+        struct { uint32_t addr; } ip4;
+    } u_addr;
+    uint8_t type;
+} ip_addr_t;
+
+#define IPADDR_TYPE_V4 0
+#define IPADDR_TYPE_V6 6
+#define IPADDR_TYPE_ANY 46
+#define IP_IS_V6(ipaddr) ((ipaddr)->type == IPADDR_TYPE_V6)
+#define ip_2_ip6(ipaddr) (&(ipaddr)->u_addr.ip6)
+#define ip_2_ip4(ipaddr) (&(ipaddr)->u_addr.ip4)
+
+extern const ip_addr_t ip_addr_any_type;
+#define IP_ANY_TYPE (&ip_addr_any_type)
+
+struct pbuf;
+struct udp_pcb;
+
+typedef enum { PBUF_TRANSPORT } pbuf_layer;
+typedef enum { PBUF_RAM } pbuf_type;
+
+typedef void (*udp_recv_fn)(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, u16_t port);
+
+struct pbuf* pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+uint8_t pbuf_free(struct pbuf* p);
+u16_t pbuf_copy_partial(const struct pbuf* p, void* dataptr, u16_t len, u16_t offset);
+err_t pbuf_take(struct pbuf* p, const void* dataptr, u16_t len);
+
+struct udp_pcb* udp_new_ip_type(uint8_t type);
+err_t udp_bind(struct udp_pcb* pcb, const ip_addr_t* ipaddr, u16_t port);
+void udp_recv(struct udp_pcb* pcb, udp_recv_fn recv, void* recv_arg);
+err_t udp_sendto(struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* dst_ip, u16_t dst_port);
+void udp_remove(struct udp_pcb* pcb);
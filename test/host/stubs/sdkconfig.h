@@ -0,0 +1,5 @@
+#pragma once
+
+// Options of the component the host builds need, as a default sdkconfig sets them
+#define CONFIG_LWIP_IPV6 1
+#define CONFIG_LOG_DEFAULT_LEVEL 2
@@ -0,0 +1,166 @@
+/*
+    Replay of the connectivity probes iOS, Android and Windows send after joining the softAP. Every probe must get
+    the prebuilt 302 to the portal and count a hit; the portal's own requests must fall through to the handlers.
+*/
+#include <string.h>
+#include <strings.h>
+
+#include "esp_netif.h"
+#include "captive_probe.h"
+#include "host_test.h"
+
+typedef struct
+{
+    const char* host;
+    char sent[512];
+    size_t sent_len;
+    int sends;
+} fake_req_t;
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* r, const char* field, char* val, const size_t val_size)
+{
+    const fake_req_t* fake = r->aux;
+    if (strcasecmp(field, "Host") != 0 || fake->host == NULL)
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+    const size_t len = strlen(fake->host);
+    if (len >= val_size)
+    {
+        memcpy(val, fake->host, val_size - 1);
+        val[val_size - 1] = '\0';
+        return ESP_ERR_HTTPD_RESULT_TRUNC;
+    }
+    memcpy(val, fake->host, len + 1);
+    return ESP_OK;
+}
+
+int httpd_send(httpd_req_t* r, const char* buf, const size_t buf_len)
+{
+    fake_req_t* fake = r->aux;
+    CHECK(buf_len < sizeof(fake->sent));
+    memcpy(fake->sent, buf, buf_len);
+    fake->sent[buf_len] = '\0';
+    fake->sent_len = buf_len;
+    fake->sends++;
+    return (int)buf_len;
+}
+
+typedef struct
+{
+    const char* host;
+    const char* uri;
+} request_t;
+
+static const request_t ios[] = {
+    {"captive.apple.com", "/hotspot-detect.html"},
+    {"captive.apple.com", "/hotspot-detect.html"},
+    {"www.apple.com", "/library/test/success.html"},
+    {"captive.apple.com", "/"},
+};
+
+static const request_t android[] = {
+    {"connectivitycheck.gstatic.com", "/generate_204"},
+    {"www.google.com", "/gen_204"},
+    {"clients3.google.com", "/generate_204"},
+    {"connectivitycheck.gstatic.com", "/generate_204"},
+    {"www.gstatic.com", "/generate_204?hl=en"},
+    {"connectivitycheck.android.com", "/"},
+};
+
+static const request_t windows[] = {
+    {"www.msftconnecttest.com", "/connecttest.txt"},
+    {"www.msftncsi.com", "/ncsi.txt"},
+    {"www.msftconnecttest.com", "/redirect"},
+    {"WWW.MSFTCONNECTTEST.COM:80", "/"},
+};
+
+// The portal page and its own requests, whatever the Host says
+static const request_t portal[] = {
+    {"192.168.4.1", "/"},
+    {"192.168.4.1", "/scan"},
+    {"192.168.4.1", "/favicon.ico"},
+    {NULL, "/status"},
+    {"example.com", "/generate_2040"},
+    {"a-host-name-longer-than-the-header-buffer-of-the-probe-table.example", "/"},
+};
+
+static const char* expected;
+
+/*
+    Returns true if the request was answered as a probe, checking the response
+*/
+static bool replay(const request_t* request)
+{
+    fake_req_t fake = {.host = request->host};
+    httpd_req_t req = {.uri = request->uri, .aux = &fake};
+    const bool handled = captive_probe_handle(&req);
+    CHECK(fake.sends == (handled ? 1 : 0));
+    if (handled)
+    {
+        CHECK(strcmp(fake.sent, expected) == 0);
+    }
+    return handled;
+}
+
+static uint32_t total_hits(const char* os)
+{
+    int count;
+    const captive_probe_t* probes = captive_probe_get_table(&count);
+    uint32_t hits = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (os == NULL || strcmp(probes[i].os, os) == 0)
+        {
+            hits += probes[i].hits;
+        }
+    }
+    return hits;
+}
+
+static void replay_all(const char* os, const request_t* requests, const int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!replay(&requests[i]))
+        {
+            fprintf(stderr, "%s probe not answered: %s%s\n", os, requests[i].host, requests[i].uri);
+            exit(1);
+        }
+    }
+    CHECK(total_hits(os) == count);
+    printf("%s: %d probes answered\n", os, count);
+}
+
+int main(void)
+{
+    CHECK(captive_probe_init(ESP_IP4TOADDR(192, 168, 4, 1)) == ESP_OK);
+    expected = "HTTP/1.1 302 Found\r\n"
+               "Location: http://192.168.4.1/\r\n"
+               "Content-Type: text/html\r\n"
+               "Cache-Control: no-store\r\n"
+               "Content-Length: 40\r\n"
+               "\r\n"
+               "<a href=\"http://192.168.4.1/\">Portal</a>";
+
+    replay_all("apple", ios, sizeof(ios) / sizeof(ios[0]));
+    replay_all("android", android, sizeof(android) / sizeof(android[0]));
+    replay_all("windows", windows, sizeof(windows) / sizeof(windows[0]));
+
+    const uint32_t hits = total_hits(NULL);
+    for (int i = 0; i < sizeof(portal) / sizeof(portal[0]); i++)
+    {
+        if (replay(&portal[i]))
+        {
+            fprintf(stderr, "portal request taken as a probe: %s%s\n", portal[i].host, portal[i].uri);
+            exit(1);
+        }
+    }
+    CHECK(total_hits(NULL) == hits);
+    printf("portal: %d requests passed through\n", (int)(sizeof(portal) / sizeof(portal[0])));
+
+    // A new start clears the counters
+    CHECK(captive_probe_init(ESP_IP4TOADDR(10, 0, 0, 1)) == ESP_OK);
+    CHECK(total_hits(NULL) == 0);
+    return 0;
+}
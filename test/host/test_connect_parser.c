@@ -0,0 +1,85 @@
+/*
+    /connect bodies in both formats, fed whole and one byte at a time as they may arrive from the socket
+*/
+#include <string.h>
+
+#include "connect_parser.h"
+#include "host_test.h"
+
+static wifi_sta_config_t sta;
+static connect_parser_t parser;
+
+static esp_err_t parse(const connect_parser_format_t format, const char* body, const bool bytewise)
+{
+    connect_parser_init(&parser, format, &sta);
+    esp_err_t err = ESP_OK;
+    const size_t len = strlen(body);
+    if (bytewise)
+    {
+        for (size_t i = 0; i < len && err == ESP_OK; i++)
+        {
+            err = connect_parser_feed(&parser, body + i, 1);
+        }
+    }
+    else
+    {
+        err = connect_parser_feed(&parser, body, len);
+    }
+    return err == ESP_OK ? connect_parser_finish(&parser) : err;
+}
+
+static void test_json(const bool bytewise)
+{
+    CHECK(parse(CONNECT_PARSER_JSON, " { \"ssid\" : \"My \\\"Net\\u00e9\" , \"password\":\"secret12\","
+                "\"unknown_long_key\":\"zz\",\"n\":null,\"channel\":6,\"hidden\":true,\"bssid\":\"aa:BB:cc:00:11:22\"} ",
+                bytewise) == ESP_OK);
+    CHECK(strcmp((const char*)sta.ssid, "My \"Net\xc3\xa9") == 0);
+    CHECK(strcmp((const char*)sta.password, "secret12") == 0);
+    CHECK(sta.channel == 6 && parser.hidden);
+    CHECK(sta.bssid_set && sta.bssid[0] == 0xaa && sta.bssid[1] == 0xbb && sta.bssid[5] == 0x22);
+
+    // 32 bytes fill the SSID without a terminator, one more does not fit
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"ssid\":\"0123456789abcdef0123456789abcdef\"}", bytewise) == ESP_OK);
+    CHECK(memcmp(sta.ssid, "0123456789abcdef0123456789abcdef", 32) == 0);
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"ssid\":\"0123456789abcdef0123456789abcdefX\"}", bytewise) ==
+          ESP_ERR_INVALID_SIZE);
+
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"password\":\"x\"}", bytewise) == ESP_ERR_NOT_FOUND);
+    CHECK(parse(CONNECT_PARSER_JSON, "{}", bytewise) == ESP_ERR_NOT_FOUND);
+    CHECK(parse(CONNECT_PARSER_JSON, "", bytewise) == ESP_ERR_INVALID_ARG);
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"ssid\":\"a\"", bytewise) == ESP_ERR_INVALID_ARG);
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"ssid\":5}", bytewise) == ESP_ERR_INVALID_ARG);
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"ssid\":\"a\",\"x\":[1]}", bytewise) == ESP_ERR_INVALID_ARG);
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"ssid\":\"a\",\"channel\":\"300\"}", bytewise) == ESP_ERR_INVALID_ARG);
+    CHECK(parse(CONNECT_PARSER_JSON, "{\"ssid\":\"a\",\"bssid\":\"aa:bb\"}", bytewise) == ESP_ERR_INVALID_ARG);
+}
+
+static void test_form(const bool bytewise)
+{
+    CHECK(parse(CONNECT_PARSER_FORM, "ssid=My+Net%C3%A9%26&password=p%40ss+word&bssid=&hidden=on", bytewise) ==
+          ESP_OK);
+    CHECK(strcmp((const char*)sta.ssid, "My Net\xc3\xa9&") == 0);
+    CHECK(strcmp((const char*)sta.password, "p@ss word") == 0);
+    CHECK(!sta.bssid_set && parser.hidden);
+
+    // A checkbox left unchecked is not sent, a bare key is no value
+    CHECK(parse(CONNECT_PARSER_FORM, "password=x&ssid=a&hidden", bytewise) == ESP_OK);
+    CHECK(strcmp((const char*)sta.ssid, "a") == 0 && !parser.hidden);
+
+    CHECK(parse(CONNECT_PARSER_FORM, "ssid=a%2", bytewise) == ESP_ERR_INVALID_ARG);
+    CHECK(parse(CONNECT_PARSER_FORM, "ssid=a%zz", bytewise) == ESP_ERR_INVALID_ARG);
+    CHECK(parse(CONNECT_PARSER_FORM, "ssid=", bytewise) == ESP_ERR_NOT_FOUND);
+}
+
+int main(void)
+{
+    const size_t calls = alloc_count_calls();
+    for (int bytewise = 0; bytewise < 2; bytewise++)
+    {
+        test_json(bytewise);
+        test_form(bytewise);
+    }
+    CHECK(alloc_count_calls() == calls);
+    printf("connect_parser: JSON and form bodies, whole and byte by byte, no allocations\n");
+    return 0;
+}
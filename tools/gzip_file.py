@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+"""Gzip a file reproducibly: no file name and a zero mtime in the header, so the output only changes with the input.
+
+With --split, the file is compressed as two independent halves around a marker, so a server can send the first half,
+insert content of its own as stored deflate blocks in place of the marker, and send the second half. The output then
+is the gzip header and the first half ending on a byte boundary (a full flush, not final), the second half as raw
+deflate ending with the final block, and the length of the first part as a 32 bit little endian number. The trailer
+(CRC-32 and size) is left to the server, as it depends on the inserted content.
+"""
+
+import argparse
+import gzip
+import struct
+import sys
+import zlib
+
+# ID1 ID2, deflate, no flags, mtime 0, maximum compression, unknown OS
+GZIP_HEADER = bytes([0x1F, 0x8B, 0x08, 0x00, 0, 0, 0, 0, 0x02, 0xFF])
+
+
+def raw_deflate(data, mode):
+    compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+    return compressor.compress(data) + compressor.flush(mode)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="file to compress")
+    parser.add_argument("output", help="gzip file to write")
+    parser.add_argument("--split", metavar="MARKER", help="compress the halves around MARKER independently")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    if args.split is None:
+        with open(args.output, "wb") as f:
+            with gzip.GzipFile(filename="", mode="wb", fileobj=f, compresslevel=9, mtime=0) as gz:
+                gz.write(data)
+        return
+
+    marker = args.split.encode()
+    if data.count(marker) != 1:
+        sys.exit("%s must hold the marker %s exactly once" % (args.input, args.split))
+    head, tail = data.split(marker)
+    # The full flush ends the first half byte-aligned without back references into what the server inserts
+    first = GZIP_HEADER + raw_deflate(head, zlib.Z_FULL_FLUSH)
+    second = raw_deflate(tail, zlib.Z_FINISH)
+    with open(args.output, "wb") as f:
+        f.write(first + second + struct.pack("<I", len(first)))
+
+
+if __name__ == "__main__":
+    main()
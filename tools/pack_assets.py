@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Pack a directory into the asset bundle served by the portal (see asset_bundle.h for the layout).
+
+Every file is served at its path relative to the directory, e.g. `app.js` at `/app.js`. Text files are stored
+gzip-compressed when that makes them smaller.
+"""
+
+import argparse
+import gzip
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x31424150  # "PAB1"
+VERSION = 1
+ENCODING_IDENTITY = 0
+ENCODING_GZIP = 1
+
+HEADER = struct.Struct("<IHHHHI")
+RECORD = struct.Struct("<IIIIIIB3x")
+
+MIME_TYPES = {
+    ".html": "text/html",
+    ".htm": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".mjs": "application/javascript",
+    ".json": "application/json",
+    ".txt": "text/plain",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".jpeg": "image/jpeg",
+    ".gif": "image/gif",
+    ".ico": "image/x-icon",
+    ".webp": "image/webp",
+    ".woff": "font/woff",
+    ".woff2": "font/woff2",
+}
+
+COMPRESSIBLE = ("text/", "application/javascript", "application/json", "image/svg+xml", "image/x-icon")
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def align4(n):
+    return (n + 3) & ~3
+
+
+def collect(src_dir):
+    assets = []
+    for root, dirs, files in os.walk(src_dir):
+        dirs.sort()
+        for name in sorted(files):
+            full = os.path.join(root, name)
+            path = "/" + os.path.relpath(full, src_dir).replace(os.sep, "/")
+            mime = MIME_TYPES.get(os.path.splitext(name)[1].lower(), "application/octet-stream")
+            with open(full, "rb") as f:
+                data = f.read()
+            encoding = ENCODING_IDENTITY
+            if mime.startswith(COMPRESSIBLE):
+                # No name and mtime 0, so the bundle only changes with its content
+                packed = gzip.compress(data, compresslevel=9, mtime=0)
+                if len(packed) < len(data):
+                    data, encoding = packed, ENCODING_GZIP
+            assets.append((path.encode(), mime.encode(), data, encoding))
+    return assets
+
+
+def pack(assets):
+    count = len(assets)
+    slots = 2
+    while slots < 2 * count:
+        slots *= 2
+    if count > 0xFFFF or slots > 0xFFFF:
+        raise ValueError("too many assets")
+
+    records_off = align4(HEADER.size + 2 * slots)
+    strings_off = records_off + RECORD.size * count
+    strings = bytearray()
+    string_offs = []
+    for path, mime, _, _ in assets:
+        string_offs.append((strings_off + len(strings), strings_off + len(strings) + len(path) + 1))
+        strings += path + b"\0" + mime + b"\0"
+
+    data_off = align4(strings_off + len(strings))
+    content = bytearray()
+    records = bytearray()
+    table = [0] * slots
+    for index, ((path, _, data, encoding), (path_off, mime_off)) in enumerate(zip(assets, string_offs)):
+        h = fnv1a(path)
+        slot = h & (slots - 1)
+        while table[slot]:
+            slot = (slot + 1) & (slots - 1)
+        table[slot] = index + 1
+        records += RECORD.pack(h, path_off, mime_off, data_off + len(content), len(data),
+                               zlib.crc32(data) & 0xFFFFFFFF, encoding)
+        content += data
+        content += b"\0" * (align4(len(content)) - len(content))
+
+    out = bytearray(HEADER.pack(MAGIC, VERSION, count, slots, 0, 0))
+    out += struct.pack("<%dH" % slots, *table)
+    out += b"\0" * (records_off - len(out))
+    out += records
+    out += strings
+    out += b"\0" * (data_off - len(out))
+    out += content
+    struct.pack_into("<I", out, HEADER.size - 4, len(out))
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("src_dir", help="directory holding the assets")
+    parser.add_argument("output", help="bundle image to write")
+    parser.add_argument("--max-size", type=lambda s: int(s, 0), help="size of the partition the bundle goes to")
+    args = parser.parse_args()
+
+    assets = collect(args.src_dir)
+    image = pack(assets)
+    if args.max_size is not None and len(image) > args.max_size:
+        sys.exit("asset bundle of %d bytes does not fit the %d byte partition" % (len(image), args.max_size))
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print("Packed %d assets, %d bytes" % (len(assets), len(image)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""Load the portal's web server the way phones joining the softAP do, to compare the web server profiles.
+
+Each simulated phone runs, until the time is up:
+- an OS connectivity probe on a fresh connection every few seconds, which must get the 302 to the portal;
+- the captive portal helper on one keep-alive connection: the page, /scan, then /status polls;
+- optionally the page's WebSocket on /ws, held open.
+
+Run it from a machine joined to the softAP, once per profile. The report has the latency percentiles per request kind,
+and the connections the server dropped: a keep-alive connection found closed when it is reused, or a held WebSocket
+closing, is a socket purged for another one. A request that fails on a fresh connection counts as failed.
+"""
+
+import argparse
+import http.client
+import random
+import socket
+import threading
+import time
+
+PROBES = [
+    ("connectivitycheck.gstatic.com", "/generate_204"),
+    ("captive.apple.com", "/hotspot-detect.html"),
+    ("www.msftconnecttest.com", "/connecttest.txt"),
+]
+
+DROPPED = (http.client.RemoteDisconnected, http.client.BadStatusLine, ConnectionResetError, BrokenPipeError)
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latency = {}
+        self.failed = {}
+        self.dropped = 0
+        self.ws_dropped = 0
+
+    def add(self, kind, seconds):
+        with self.lock:
+            self.latency.setdefault(kind, []).append(seconds * 1000)
+
+    def fail(self, kind):
+        with self.lock:
+            self.failed[kind] = self.failed.get(kind, 0) + 1
+
+    def drop(self, ws=False):
+        with self.lock:
+            if ws:
+                self.ws_dropped += 1
+            else:
+                self.dropped += 1
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+class Phone(threading.Thread):
+    def __init__(self, args, stats, deadline):
+        super().__init__(daemon=True)
+        self.args = args
+        self.stats = stats
+        self.deadline = deadline
+        self.conn = None
+        self.ws = None
+
+    def request(self, kind, path):
+        """One request on the keep-alive connection, reconnecting once like a browser if the server dropped it"""
+        for retry in (False, True):
+            fresh = self.conn is None
+            if fresh:
+                self.conn = http.client.HTTPConnection(self.args.host, self.args.port, timeout=self.args.timeout)
+            start = time.monotonic()
+            try:
+                self.conn.request("GET", path)
+                response = self.conn.getresponse()
+                response.read()
+            except DROPPED:
+                self.conn.close()
+                self.conn = None
+                if fresh or retry:
+                    self.stats.fail(kind)
+                    return
+                self.stats.drop()
+                continue
+            except OSError:
+                self.conn.close()
+                self.conn = None
+                self.stats.fail(kind)
+                return
+            if response.status != 200:
+                self.stats.fail(kind)
+            else:
+                self.stats.add(kind, time.monotonic() - start)
+            if response.will_close:
+                self.conn.close()
+                self.conn = None
+            return
+
+    def probe(self):
+        host, path = random.choice(PROBES)
+        start = time.monotonic()
+        conn = http.client.HTTPConnection(self.args.host, self.args.port, timeout=self.args.timeout)
+        try:
+            conn.request("GET", path, headers={"Host": host, "Connection": "close"})
+            response = conn.getresponse()
+            response.read()
+            if response.status == 302:
+                self.stats.add("probe", time.monotonic() - start)
+            else:
+                self.stats.fail("probe")
+        except OSError:
+            self.stats.fail("probe")
+        finally:
+            conn.close()
+
+    def open_ws(self):
+        start = time.monotonic()
+        try:
+            sock = socket.create_connection((self.args.host, self.args.port), timeout=self.args.timeout)
+            key = "dGhlIHNhbXBsZSBub25jZQ=="
+            sock.sendall(("GET /ws HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n" % (self.args.host, key)).encode())
+            if not sock.recv(1024).startswith(b"HTTP/1.1 101"):
+                sock.close()
+                self.stats.fail("ws")
+                return
+        except OSError:
+            self.stats.fail("ws")
+            return
+        self.stats.add("ws", time.monotonic() - start)
+        sock.setblocking(False)
+        self.ws = sock
+
+    def check_ws(self):
+        """Drain pushed frames, a closed socket was purged"""
+        try:
+            while self.ws.recv(4096):
+                pass
+        except BlockingIOError:
+            return
+        except OSError:
+            pass
+        self.ws.close()
+        self.ws = None
+        self.stats.drop(ws=True)
+
+    def run(self):
+        next_probe = 0
+        load_page = True
+        while time.monotonic() < self.deadline:
+            if time.monotonic() >= next_probe:
+                self.probe()
+                next_probe = time.monotonic() + random.uniform(2, 6)
+            if load_page:
+                self.request("page", "/")
+                self.request("scan", "/scan")
+                load_page = False
+            if self.args.ws:
+                if self.ws is None:
+                    self.open_ws()
+                else:
+                    self.check_ws()
+            self.request("status", "/status")
+            time.sleep(random.uniform(0.5, 1.5))
+            # Now and then the user reloads
+            if random.random() < 0.05:
+                load_page = True
+        if self.conn:
+            self.conn.close()
+        if self.ws:
+            self.ws.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host", nargs="?", default="192.168.4.1", help="softAP address of the portal")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--phones", type=int, default=4, help="phones joined at once")
+    parser.add_argument("--duration", type=float, default=60, help="seconds to run")
+    parser.add_argument("--timeout", type=float, default=10, help="seconds a request may take")
+    parser.add_argument("--no-ws", dest="ws", action="store_false", help="do not hold a WebSocket per phone")
+    args = parser.parse_args()
+
+    stats = Stats()
+    deadline = time.monotonic() + args.duration
+    phones = [Phone(args, stats, deadline) for _ in range(args.phones)]
+    for phone in phones:
+        phone.start()
+        # Phones do not join in the same millisecond
+        time.sleep(random.uniform(0, 0.3))
+    for phone in phones:
+        phone.join()
+
+    print("%d phones for %.0f s%s" % (args.phones, args.duration, ", each holding a WebSocket" if args.ws else ""))
+    print("%-8s %7s %8s %8s %8s %7s" % ("request", "count", "p50 ms", "p99 ms", "max ms", "failed"))
+    for kind in ("probe", "page", "scan", "status", "ws"):
+        values = stats.latency.get(kind, [])
+        failed = stats.failed.get(kind, 0)
+        if not values and not failed:
+            continue
+        if values:
+            print("%-8s %7d %8.0f %8.0f %8.0f %7d" % (kind, len(values), percentile(values, 50),
+                                                      percentile(values, 99), max(values), failed))
+        else:
+            print("%-8s %7d %8s %8s %8s %7d" % (kind, 0, "-", "-", "-", failed))
+    print("keep-alive connections dropped: %d, WebSockets dropped: %d" % (stats.dropped, stats.ws_dropped))
+
+
+if __name__ == "__main__":
+    main()